@@ -1,13 +1,18 @@
 // font_renderer.c
-// Text renderer with per-glyph caching, kerning cache, and newline support
+// UTF-8 text renderer with a packed ASCII atlas, a bounded glyph cache for
+// everything else, kerning loaded up front, and newline support
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <time.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stb_truetype.h"
@@ -17,6 +22,17 @@
 #define FONT_SIZE   24
 #define FIRST_CHAR  32
 #define NUM_CHARS   96  // ASCII 32..127
+#define ATLAS_W     512
+#ifndef GLYPH_CACHE_BYTES
+#define GLYPH_CACHE_BYTES (256 * 1024)  // bitmaps of glyphs outside ASCII
+#endif
+// Horizontal subpixel positioning: each glyph is rasterized at this many
+// evenly spaced fractional x offsets, and the one nearest the pen is drawn.
+// 1 snaps glyphs to whole pixels; 2, 4 or 8 cost that many times the
+// atlas and slot memory.
+#ifndef SUBPIXEL_PHASES
+#define SUBPIXEL_PHASES 1
+#endif
 
 // X11 globals
 static Display   *dpy;
@@ -31,19 +47,51 @@ static float            scale;
 static float            ascent, descent, lineGap;
 static unsigned char   *font_buffer;
 
-// Glyph cache entry
+// Glyph cache entry, the bitmap is w x h with rows `stride` bytes apart
 typedef struct {
-    int     loaded;
-    unsigned char *bitmap;
+    const unsigned char *bitmap;
+    int     stride;
+    int     glyph;      // glyph index, for kerning
     int     w, h;
     int     xoff, yoff;
     float   advance;
 } CachedGlyph;
-static CachedGlyph cache[NUM_CHARS];
+static CachedGlyph cache[NUM_CHARS * SUBPIXEL_PHASES];   // [char][phase]
 
-// Kerning cache
-static float         kern_cache[NUM_CHARS][NUM_CHARS];
-static unsigned char kern_loaded[NUM_CHARS][NUM_CHARS];
+// ASCII packed into one 8-bit texture, ATLAS_W wide
+static unsigned char *atlas;
+static int            atlas_h;
+
+// Glyphs outside ASCII: as many slots as GLYPH_CACHE_BYTES has room for,
+// each with a cell big enough for any glyph of the font, found through an
+// open-addressing table keyed by glyph index and phase. Once every slot is
+// taken, CLOCK hands out one that hasn't been used since the hand last
+// passed.
+typedef struct {
+    int           key;      // glyph * SUBPIXEL_PHASES + phase, -1 while free
+    unsigned char used;     // CLOCK reference bit
+    CachedGlyph   cg;
+} GlyphSlot;
+static GlyphSlot     *slots;
+static int            num_slots;
+static int            clock_hand;
+static int           *slot_table;   // slot index or -1, linear probing
+static int            table_mask;
+static unsigned char *cells;        // num_slots cells of cell_w x cell_h
+static int            cell_w, cell_h;
+
+// Kerning, looked up at load_font: every nonzero pair sorted by glyph
+// index, and a bit per glyph that has pairs with it on the left, so most
+// pairs are settled without a search
+typedef struct {
+    uint32_t key;       // glyph1 << 16 | glyph2
+    int      advance;   // font units
+} KernPair;
+static KernPair      *kern_pairs;
+static int            num_kern_pairs;
+static unsigned char *kern_left;
+static unsigned char *kern_probed;     // pairs among these are all in kern_pairs
+static int            kern_complete;   // every pair of the font is in kern_pairs
 
 static double now_sec(void) {
     struct timespec t;
@@ -74,6 +122,180 @@ void init_x11(void) {
     if (!ximage) { fprintf(stderr, "XCreateImage failed\n"); exit(1); }
 }
 
+static float phase_shift(int phase) {
+    return (float)phase / SUBPIXEL_PHASES;
+}
+
+// Rasterize every phase of the whole range up front into the atlas.
+// stbtt's packer fails when the rects don't fit, so start small and
+// double the height until they do.
+static void build_atlas(void) {
+    enum { N = NUM_CHARS * SUBPIXEL_PHASES };
+    stbrp_rect rects[N];
+    for (int k = 0; k < N; ++k) {
+        CachedGlyph *cg = &cache[k];
+        int ix0, iy0, ix1, iy1, adv_i, lsb;
+        cg->glyph = stbtt_FindGlyphIndex(&font, FIRST_CHAR + k / SUBPIXEL_PHASES);
+        stbtt_GetGlyphBitmapBoxSubpixel(&font, cg->glyph, scale, scale,
+                                        phase_shift(k % SUBPIXEL_PHASES), 0,
+                                        &ix0, &iy0, &ix1, &iy1);
+        stbtt_GetGlyphHMetrics(&font, cg->glyph, &adv_i, &lsb);
+        cg->stride  = ATLAS_W;
+        cg->w       = ix1 - ix0;
+        cg->h       = iy1 - iy0;
+        cg->xoff    = ix0;
+        cg->yoff    = iy0;
+        cg->advance = adv_i * scale;
+        rects[k].id = k;
+        rects[k].w  = cg->w + 1;    // the pack context's padding
+        rects[k].h  = cg->h + 1;
+    }
+
+    for (atlas_h = 64; ; atlas_h *= 2) {
+        atlas = calloc(ATLAS_W * atlas_h, 1);
+        if (!atlas) { perror("calloc"); exit(1); }
+        stbtt_pack_context spc;
+        if (!stbtt_PackBegin(&spc, atlas, ATLAS_W, atlas_h, 0, 1, NULL)) {
+            fprintf(stderr, "stbtt_PackBegin failed\n"); exit(1);
+        }
+        stbtt_PackFontRangesPackRects(&spc, rects, N);
+        stbtt_PackEnd(&spc);
+        int ok = 1;
+        for (int k = 0; k < N; ++k) ok &= rects[k].was_packed;
+        if (ok) break;
+        free(atlas);
+    }
+
+    for (int k = 0; k < N; ++k) {
+        CachedGlyph *cg = &cache[k];
+        unsigned char *dst = atlas + rects[k].y * ATLAS_W + rects[k].x;
+        stbtt_MakeGlyphBitmapSubpixel(&font, dst, cg->w, cg->h, ATLAS_W, scale, scale,
+                                      phase_shift(k % SUBPIXEL_PHASES), 0, cg->glyph);
+        cg->bitmap = dst;
+    }
+}
+
+static void init_glyph_slots(void) {
+    int x0, y0, x1, y1;
+    stbtt_GetFontBoundingBox(&font, &x0, &y0, &x1, &y1);
+    // rounding out to whole pixels, and a shift, widen a box by up to 3
+    cell_w = (int)((x1 - x0) * scale) + 3;
+    cell_h = (int)((y1 - y0) * scale) + 2;
+
+    num_slots = GLYPH_CACHE_BYTES / (cell_w * cell_h);
+    if (num_slots < 1) num_slots = 1;
+    int table_size = 1;
+    while (table_size < 2 * num_slots) table_size *= 2;
+    table_mask = table_size - 1;
+    clock_hand = 0;
+
+    slots      = malloc(num_slots * sizeof(*slots));
+    slot_table = malloc(table_size * sizeof(*slot_table));
+    cells      = malloc((size_t)num_slots * cell_w * cell_h);
+    if (!slots || !slot_table || !cells) { perror("malloc"); exit(1); }
+    for (int i = 0; i < num_slots; ++i) slots[i].key = -1;
+    for (int i = 0; i < table_size; ++i) slot_table[i] = -1;
+}
+
+static int get_bit(const unsigned char *bits, int g) {
+    return bits[g >> 3] >> (g & 7) & 1;
+}
+
+static void set_bit(unsigned char *bits, int g) {
+    if (g < font.numGlyphs) bits[g >> 3] |= 1 << (g & 7);
+}
+
+static int u16(const unsigned char *p) {
+    return p[0] << 8 | p[1];
+}
+
+// Marks every glyph that a GPOS pair adjustment subtable covers as the
+// first of a pair. stbtt only reads some of those, so this can only err
+// on the side of searching.
+static void mark_gpos_left(void) {
+    const unsigned char *gpos = font.data + font.gpos;
+    if (u16(gpos) != 1 || u16(gpos + 2) != 0) return;
+    const unsigned char *lookups = gpos + u16(gpos + 8);
+    for (int i = 0; i < u16(lookups); ++i) {
+        const unsigned char *lookup = lookups + u16(lookups + 2 + 2 * i);
+        if (u16(lookup) != 2) continue;
+        for (int j = 0; j < u16(lookup + 4); ++j) {
+            const unsigned char *sub = lookup + u16(lookup + 6 + 2 * j);
+            const unsigned char *cov = sub + u16(sub + 2);
+            int count = u16(cov + 2);
+            for (int k = 0; k < count; ++k) {
+                if (u16(cov) == 1) {
+                    set_bit(kern_left, u16(cov + 4 + 2 * k));
+                } else if (u16(cov) == 2) {
+                    const unsigned char *range = cov + 4 + 6 * k;
+                    for (int g = u16(range); g <= u16(range + 2); ++g) set_bit(kern_left, g);
+                }
+            }
+        }
+    }
+}
+
+static int cmp_kern(const void *a, const void *b) {
+    uint32_t ka = ((const KernPair *)a)->key, kb = ((const KernPair *)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+// stbtt reads GPOS when the font has one and the old kern table only when
+// it doesn't. A kern table can be listed whole; GPOS can't, so for those
+// fonts the pairs among ASCII are looked up now and any others by
+// get_kerning when they come up.
+static void load_kerning(void) {
+    int bytes = (font.numGlyphs + 7) / 8;
+    kern_left   = calloc(bytes, 1);
+    kern_probed = calloc(bytes, 1);
+    if (!kern_left || !kern_probed) { perror("calloc"); exit(1); }
+    num_kern_pairs = 0;
+    kern_complete  = 0;
+
+    if (font.gpos) {
+        mark_gpos_left();
+        kern_pairs = malloc(NUM_CHARS * NUM_CHARS * sizeof(*kern_pairs));
+        if (!kern_pairs) { perror("malloc"); exit(1); }
+        for (int i = 0; i < NUM_CHARS; ++i) {
+            int g1 = cache[i * SUBPIXEL_PHASES].glyph;
+            set_bit(kern_probed, g1);
+            if (!get_bit(kern_left, g1)) continue;
+            for (int j = 0; j < NUM_CHARS; ++j) {
+                int g2 = cache[j * SUBPIXEL_PHASES].glyph;
+                int adv = stbtt_GetGlyphKernAdvance(&font, g1, g2);
+                if (adv) {
+                    kern_pairs[num_kern_pairs].key     = (uint32_t)g1 << 16 | g2;
+                    kern_pairs[num_kern_pairs].advance = adv;
+                    num_kern_pairs++;
+                }
+            }
+        }
+    } else {
+        int len = stbtt_GetKerningTableLength(&font);
+        stbtt_kerningentry *table = malloc((len + 1) * sizeof(*table));
+        kern_pairs = malloc((len + 1) * sizeof(*kern_pairs));
+        if (!table || !kern_pairs) { perror("malloc"); exit(1); }
+        len = stbtt_GetKerningTable(&font, table, len);
+        for (int k = 0; k < len; ++k) {
+            if (!table[k].advance) continue;
+            kern_pairs[num_kern_pairs].key     = (uint32_t)table[k].glyph1 << 16 | table[k].glyph2;
+            kern_pairs[num_kern_pairs].advance = table[k].advance;
+            num_kern_pairs++;
+            set_bit(kern_left, table[k].glyph1);
+        }
+        free(table);
+        kern_complete = 1;
+    }
+
+    // the same glyph can stand for several code points, keep one of each pair
+    qsort(kern_pairs, num_kern_pairs, sizeof(*kern_pairs), cmp_kern);
+    int n = 0;
+    for (int k = 0; k < num_kern_pairs; ++k) {
+        if (n == 0 || kern_pairs[k].key != kern_pairs[n - 1].key) kern_pairs[n++] = kern_pairs[k];
+    }
+    num_kern_pairs = n;
+}
+
 void load_font(const char *path) {
     FILE *f = fopen(path, "rb");
     if (!f) { perror("fopen"); exit(1); }
@@ -95,98 +317,361 @@ void load_font(const char *path) {
     descent  = id * scale;
     lineGap  = ig * scale;
 
-    memset(cache,       0, sizeof(cache));
-    memset(kern_loaded, 0, sizeof(kern_loaded));
-}
-
-static CachedGlyph* get_glyph(int cp) {
-    if (cp < FIRST_CHAR || cp >= FIRST_CHAR + NUM_CHARS) return NULL;
-    CachedGlyph *cg = &cache[cp - FIRST_CHAR];
-    if (!cg->loaded) {
-        int w, h, xoff, yoff;
-        unsigned char *bm = stbtt_GetCodepointBitmap(&font, 0, scale,
-                                                     cp, &w, &h,
-                                                     &xoff, &yoff);
-        int adv_i, lsb;
-        stbtt_GetCodepointHMetrics(&font, cp, &adv_i, &lsb);
-        cg->bitmap  = bm;
-        cg->w       = w;
-        cg->h       = h;
-        cg->xoff    = xoff;
-        cg->yoff    = yoff;
-        cg->advance = adv_i * scale;
-        cg->loaded  = 1;
+    build_atlas();
+    init_glyph_slots();
+    load_kerning();
+}
+
+static unsigned slot_hash(int key) {
+    return ((unsigned)key * 2654435761u) & table_mask;
+}
+
+// Linear probing without tombstones: close the hole by pulling back any
+// later entry of the run whose home isn't between the hole and itself.
+static void table_remove(int key) {
+    unsigned i = slot_hash(key);
+    while (slots[slot_table[i]].key != key) i = (i + 1) & table_mask;
+    for (unsigned j = (i + 1) & table_mask; slot_table[j] >= 0; j = (j + 1) & table_mask) {
+        unsigned home = slot_hash(slots[slot_table[j]].key);
+        if (((j - home) & table_mask) >= ((j - i) & table_mask)) {
+            slot_table[i] = slot_table[j];
+            i = j;
+        }
     }
+    slot_table[i] = -1;
+}
+
+static int evict_slot(void) {
+    for (;;) {
+        int s = clock_hand;
+        clock_hand = (clock_hand + 1) % num_slots;
+        if (slots[s].key < 0) return s;
+        if (slots[s].used) { slots[s].used = 0; continue; }
+        table_remove(slots[s].key);
+        return s;
+    }
+}
+
+static CachedGlyph* get_glyph_slot(int glyph, int phase) {
+    int key = glyph * SUBPIXEL_PHASES + phase;
+    unsigned i = slot_hash(key);
+    for (; slot_table[i] >= 0; i = (i + 1) & table_mask) {
+        GlyphSlot *sl = &slots[slot_table[i]];
+        if (sl->key == key) {
+            sl->used = 1;
+            return &sl->cg;
+        }
+    }
+
+    int s = evict_slot();
+    // evicting may have shifted the probe run, find the free entry again
+    for (i = slot_hash(key); slot_table[i] >= 0; i = (i + 1) & table_mask) {}
+    slot_table[i] = s;
+
+    GlyphSlot *sl = &slots[s];
+    CachedGlyph *cg = &sl->cg;
+    int ix0, iy0, ix1, iy1, adv_i, lsb;
+    stbtt_GetGlyphBitmapBoxSubpixel(&font, glyph, scale, scale, phase_shift(phase), 0,
+                                    &ix0, &iy0, &ix1, &iy1);
+    stbtt_GetGlyphHMetrics(&font, glyph, &adv_i, &lsb);
+    unsigned char *cell = cells + (size_t)s * cell_w * cell_h;
+    cg->bitmap  = cell;
+    cg->stride  = cell_w;
+    cg->w       = ix1 - ix0 < cell_w ? ix1 - ix0 : cell_w;
+    cg->h       = iy1 - iy0 < cell_h ? iy1 - iy0 : cell_h;
+    cg->xoff    = ix0;
+    cg->yoff    = iy0;
+    cg->advance = adv_i * scale;
+    cg->glyph   = glyph;
+    stbtt_MakeGlyphBitmapSubpixel(&font, cell, cg->w, cg->h, cell_w, scale, scale,
+                                  phase_shift(phase), 0, glyph);
+    sl->key  = key;
+    sl->used = 1;
     return cg;
 }
 
-static float get_kerning(int cp1, int cp2) {
-    int i1 = cp1 - FIRST_CHAR;
-    int i2 = cp2 - FIRST_CHAR;
-    if (i1 < 0 || i1 >= NUM_CHARS || i2 < 0 || i2 >= NUM_CHARS) return 0;
-    if (!kern_loaded[i1][i2]) {
-        int kern_i = stbtt_GetCodepointKernAdvance(&font, cp1, cp2);
-        kern_cache[i1][i2] = kern_i * scale;
-        kern_loaded[i1][i2] = 1;
+// -1 for the control characters, which have nothing to draw
+static int glyph_index(int cp) {
+    if (cp < FIRST_CHAR) return -1;
+    if (cp < FIRST_CHAR + NUM_CHARS) return cache[(cp - FIRST_CHAR) * SUBPIXEL_PHASES].glyph;
+    return stbtt_FindGlyphIndex(&font, cp);
+}
+
+static CachedGlyph* get_glyph(int cp, int glyph, int phase) {
+    if (cp < FIRST_CHAR + NUM_CHARS) return &cache[(cp - FIRST_CHAR) * SUBPIXEL_PHASES + phase];
+    return get_glyph_slot(glyph, phase);
+}
+
+static float get_kerning(int g1, int g2) {
+    if (!get_bit(kern_left, g1)) return 0;
+    uint32_t key = (uint32_t)g1 << 16 | g2;
+    int l = 0, r = num_kern_pairs - 1;
+    while (l <= r) {
+        int m = (l + r) >> 1;
+        if      (key < kern_pairs[m].key) r = m - 1;
+        else if (key > kern_pairs[m].key) l = m + 1;
+        else return kern_pairs[m].advance * scale;
     }
-    return kern_cache[i1][i2];
+    if (kern_complete || (get_bit(kern_probed, g1) && get_bit(kern_probed, g2))) return 0;
+    return stbtt_GetGlyphKernAdvance(&font, g1, g2) * scale;
 }
 
-void free_cache(void) {
-    for (int i = 0; i < NUM_CHARS; ++i) {
-        if (cache[i].loaded) {
-            stbtt_FreeBitmap(cache[i].bitmap, NULL);
+// Blending a span of glyph coverage onto the framebuffer, white text:
+// each channel becomes (a*255 + (255-a)*d) / 255. A written pixel's top
+// byte is cleared, a pixel under zero coverage is left as it was.
+typedef void (*BlendSpanFn)(uint32_t *dst, const unsigned char *cov, int n);
+
+static void blend_span_scalar(uint32_t *dst, const unsigned char *cov, int n) {
+    for (int i = 0; i < n; ++i) {
+        unsigned char a = cov[i];
+        if (!a) continue;
+        uint32_t d = dst[i];
+        uint8_t dr = (d >> 16) & 0xFF;
+        uint8_t dg = (d >>  8) & 0xFF;
+        uint8_t db = (d >>  0) & 0xFF;
+        uint8_t r = (a * 255 + (255 - a) * dr) / 255;
+        uint8_t g = (a * 255 + (255 - a) * dg) / 255;
+        uint8_t b = (a * 255 + (255 - a) * db) / 255;
+        dst[i] = (r << 16) | (g << 8) | b;
+    }
+}
+
+#ifdef __x86_64__
+// The SIMD spans do the same math in 16-bit lanes. v = a*255 + (255-a)*d
+// is at most 65025, and v/255 == (v + 1 + (v >> 8)) >> 8 for every v in
+// that range, so they're bit-exact with the scalar one without a divide.
+// A zero coverage blends to the same rgb, only the top byte needs keeping.
+
+static inline __m128i blend4_sse2(__m128i d, __m128i a) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i one  = _mm_set1_epi16(1);
+    __m128i q[2];
+    for (int h = 0; h < 2; ++h) {
+        __m128i dd = h ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+        __m128i aa = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+        // a*255 + (255-a)*d == a*(255-d) + 255*d, all mod 2^16
+        __m128i v = _mm_add_epi16(_mm_mullo_epi16(aa, _mm_sub_epi16(c255, dd)),
+                                  _mm_sub_epi16(_mm_slli_epi16(dd, 8), dd));
+        v = _mm_add_epi16(v, _mm_add_epi16(one, _mm_srli_epi16(v, 8)));
+        q[h] = _mm_srli_epi16(v, 8);
+    }
+    __m128i out  = _mm_and_si128(_mm_packus_epi16(q[0], q[1]), _mm_set1_epi32(0x00FFFFFF));
+    __m128i keep = _mm_and_si128(_mm_cmpeq_epi32(a, zero), _mm_set1_epi32((int)0xFF000000));
+    return _mm_or_si128(out, _mm_and_si128(d, keep));
+}
+
+// 4 coverage bytes, each spread over the 4 bytes of its pixel
+static inline __m128i spread4_sse2(const unsigned char *cov) {
+    int c;
+    memcpy(&c, cov, 4);
+    __m128i a = _mm_cvtsi32_si128(c);
+    a = _mm_unpacklo_epi8(a, a);
+    return _mm_unpacklo_epi16(a, a);
+}
+
+static void blend_span_sse2(uint32_t *dst, const unsigned char *cov, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i d0 = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i d1 = _mm_loadu_si128((const __m128i *)(dst + i + 4));
+        d0 = blend4_sse2(d0, spread4_sse2(cov + i));
+        d1 = blend4_sse2(d1, spread4_sse2(cov + i + 4));
+        _mm_storeu_si128((__m128i *)(dst + i), d0);
+        _mm_storeu_si128((__m128i *)(dst + i + 4), d1);
+    }
+    blend_span_scalar(dst + i, cov + i, n - i);
+}
+
+// unpack and pack work within each 128-bit half, which is fine here:
+// pixels and their coverage always sit in the same half
+__attribute__((target("avx2")))
+static inline __m256i blend8_avx2(__m256i d, __m256i a) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i one  = _mm256_set1_epi16(1);
+    __m256i q[2];
+    for (int h = 0; h < 2; ++h) {
+        __m256i dd = h ? _mm256_unpackhi_epi8(d, zero) : _mm256_unpacklo_epi8(d, zero);
+        __m256i aa = h ? _mm256_unpackhi_epi8(a, zero) : _mm256_unpacklo_epi8(a, zero);
+        __m256i v = _mm256_add_epi16(_mm256_mullo_epi16(aa, _mm256_sub_epi16(c255, dd)),
+                                     _mm256_sub_epi16(_mm256_slli_epi16(dd, 8), dd));
+        v = _mm256_add_epi16(v, _mm256_add_epi16(one, _mm256_srli_epi16(v, 8)));
+        q[h] = _mm256_srli_epi16(v, 8);
+    }
+    __m256i out  = _mm256_and_si256(_mm256_packus_epi16(q[0], q[1]), _mm256_set1_epi32(0x00FFFFFF));
+    __m256i keep = _mm256_and_si256(_mm256_cmpeq_epi32(a, zero), _mm256_set1_epi32((int)0xFF000000));
+    return _mm256_or_si256(out, _mm256_and_si256(d, keep));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i spread8_avx2(const unsigned char *cov) {
+    const __m256i dup = _mm256_setr_epi8(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+                                         0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)cov));
+    return _mm256_shuffle_epi8(a, dup);
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2(uint32_t *dst, const unsigned char *cov, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i d1 = _mm256_loadu_si256((const __m256i *)(dst + i + 8));
+        d0 = blend8_avx2(d0, spread8_avx2(cov + i));
+        d1 = blend8_avx2(d1, spread8_avx2(cov + i + 8));
+        _mm256_storeu_si256((__m256i *)(dst + i), d0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 8), d1);
+    }
+    blend_span_sse2(dst + i, cov + i, n - i);
+}
+#endif
+
+static BlendSpanFn blend_span = blend_span_scalar;
+
+void init_blend(void) {
+#ifdef __x86_64__
+    blend_span = __builtin_cpu_supports("avx2") ? blend_span_avx2 : blend_span_sse2;
+#endif
+}
+
+// Runs every span blender against the scalar one: every (coverage, dst
+// channel) pair, at every span length up to 40 so all the tails are hit.
+int check_blend(void) {
+    struct { const char *name; BlendSpanFn fn; int ok; } spans[] = {
+#ifdef __x86_64__
+        { "sse2", blend_span_sse2, 1 },
+        { "avx2", blend_span_avx2, __builtin_cpu_supports("avx2") },
+#endif
+    };
+    enum { N = 256 * 256 };
+    static unsigned char cov[N];
+    static uint32_t src[N], want[N], got[N];
+    uint32_t seed = 1;
+    for (int i = 0; i < N; ++i) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t d = i & 0xFF;
+        cov[i] = i >> 8;
+        src[i] = (seed & 0xFF000000) | (d << 16) | (((d + 85) & 0xFF) << 8) | ((d + 170) & 0xFF);
+    }
+
+    int failed = 0;
+    for (size_t k = 0; k < sizeof(spans) / sizeof(spans[0]); ++k) {
+        if (!spans[k].ok) continue;
+        for (int len = 0; len <= 40; ++len) {
+            memcpy(want, src, sizeof(src));
+            memcpy(got,  src, sizeof(src));
+            for (int i = 0; i + len <= N; i += len ? len : N) {
+                blend_span_scalar(want + i, cov + i, len);
+                spans[k].fn(got + i, cov + i, len);
+            }
+            if (memcmp(want, got, sizeof(got)) != 0) {
+                fprintf(stderr, "blend %s: mismatch at span length %d\n", spans[k].name, len);
+                failed = 1;
+                break;
+            }
         }
+        if (!failed) fprintf(stderr, "blend %s: ok\n", spans[k].name);
+    }
+    return failed;
+}
+
+void free_kerning(void) {
+    free(kern_pairs);
+    free(kern_left);
+    free(kern_probed);
+    kern_pairs = NULL;
+    kern_left = NULL;
+    kern_probed = NULL;
+    num_kern_pairs = 0;
+}
+
+void free_cache(void) {
+    free(atlas);
+    free(slots);
+    free(slot_table);
+    free(cells);
+    atlas = NULL;
+    slots = NULL;
+    slot_table = NULL;
+    cells = NULL;
+}
+
+// Next code point of a UTF-8 string, moving *s past it. A malformed
+// sequence, overlong form or surrogate comes out as U+FFFD and only its
+// first byte is skipped. Never reads past the terminating 0.
+static int utf8_next(const unsigned char **s) {
+    const unsigned char *p = *s;
+    int c = p[0], n, min;
+    *s = p + 1;
+    if (c < 0x80) return c;
+    if      ((c & 0xE0) == 0xC0) { n = 1; c &= 0x1F; min = 0x80; }
+    else if ((c & 0xF0) == 0xE0) { n = 2; c &= 0x0F; min = 0x800; }
+    else if ((c & 0xF8) == 0xF0) { n = 3; c &= 0x07; min = 0x10000; }
+    else return 0xFFFD;
+    for (int i = 1; i <= n; ++i) {
+        if ((p[i] & 0xC0) != 0x80) return 0xFFFD;
+        c = (c << 6) | (p[i] & 0x3F);
     }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0xFFFD;
+    *s = p + 1 + n;
+    return c;
 }
 
 void render_text(const char *text, float x, float y_top) {
     float pen_x    = x;
     float baseline = y_top + ascent;
-    int prev_cp    = -1;
+    int prev_glyph = -1;
 
-    for (const unsigned char *p = (const unsigned char*)text; *p; ++p) {
-        int cp = *p;
+    for (const unsigned char *p = (const unsigned char*)text; *p; ) {
+        int cp = utf8_next(&p);
         if (cp == '\n') {
             pen_x    = x;
             baseline += (ascent - descent + lineGap);
-            prev_cp  = -1;
+            prev_glyph = -1;
             continue;
         }
-        if (prev_cp >= 0) {
-            pen_x += get_kerning(prev_cp, cp);
-        }
-        prev_cp = cp;
 
-        CachedGlyph *cg = get_glyph(cp);
-        if (!cg) continue;
+        int glyph = glyph_index(cp);
+        if (glyph < 0) {
+            prev_glyph = -1;
+            continue;
+        }
+        if (prev_glyph >= 0) {
+            pen_x += get_kerning(prev_glyph, glyph);
+        }
+        prev_glyph = glyph;
+
+        // whole pixels plus the nearest phase; rounding up to a whole
+        // phase count moves on to the next pixel
+        float px    = floorf(pen_x);
+        int   phase = (int)((pen_x - px) * SUBPIXEL_PHASES + 0.5f);
+        if (phase == SUBPIXEL_PHASES) {
+            px   += 1;
+            phase = 0;
+        }
+        CachedGlyph *cg = get_glyph(cp, glyph, phase);
 
-        int x0 = (int)(pen_x + cg->xoff + 0.5f);
+        int x0 = (int)px + cg->xoff;
         int y0 = (int)(baseline + cg->yoff + 0.5f);
-        for (int row = 0; row < cg->h; ++row) {
-            for (int col = 0; col < cg->w; ++col) {
-                unsigned char a = cg->bitmap[row * cg->w + col];
-                if (!a) continue;
-                int px = x0 + col;
-                int py = y0 + row;
-                if (px < 0 || px >= WIDTH || py < 0 || py >= HEIGHT)
-                    continue;
-                uint32_t dst = pixels[py * WIDTH + px];
-                uint8_t dr = (dst >> 16) & 0xFF;
-                uint8_t dg = (dst >>  8) & 0xFF;
-                uint8_t db = (dst >>  0) & 0xFF;
-                uint8_t r = (a * 255 + (255 - a) * dr) / 255;
-                uint8_t g = (a * 255 + (255 - a) * dg) / 255;
-                uint8_t b = (a * 255 + (255 - a) * db) / 255;
-                pixels[py * WIDTH + px] = (r << 16) | (g << 8) | b;
-            }
+
+        // clip the glyph rect to the window once, then blend whole rows
+        int c0 = x0 < 0 ? -x0 : 0;
+        int r0 = y0 < 0 ? -y0 : 0;
+        int c1 = x0 + cg->w > WIDTH  ? WIDTH  - x0 : cg->w;
+        int r1 = y0 + cg->h > HEIGHT ? HEIGHT - y0 : cg->h;
+        for (int row = r0; row < r1 && c0 < c1; ++row) {
+            blend_span(&pixels[(y0 + row) * WIDTH + x0 + c0],
+                       &cg->bitmap[row * cg->stride + c0], c1 - c0);
         }
         pen_x += cg->advance;
     }
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2) { fprintf(stderr, "Usage: %s font.ttf\n", argv[0]); return 1; }
+    if (argc < 2) { fprintf(stderr, "Usage: %s font.ttf | --check-blend\n", argv[0]); return 1; }
+    init_blend();
+    if (strcmp(argv[1], "--check-blend") == 0) return check_blend();
     init_x11();
     load_font(argv[1]);
     memset(pixels, 0, WIDTH * HEIGHT * sizeof(uint32_t));
@@ -214,6 +699,7 @@ int main(int argc, char **argv) {
             XPutImage(dpy, win, gc, ximage, 0, 0, 0, 0, WIDTH, HEIGHT);
     }
     free_cache();
+    free_kerning();
     stbtt_FreeBitmap(font_buffer, NULL);
     XDestroyImage(ximage);
     free(pixels);
@@ -0,0 +1,356 @@
+// bench
+//
+// Runs the runtime's benchmark suites:
+//
+//   ./tools/build.sh bench                  everything
+//   ./tools/build/bench string syscall      just those suites
+//
+// "tools" runs the cat and echo binaries that sit next to this one, a
+// fork + execve + wait4 per call, so those numbers include process
+// startup the way a shell would pay it.
+#include "../runtime/sys.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+static volatile long sink;
+
+// string
+
+struct str_arg
+{
+    char *a;          // source, n bytes of 'x' and a terminator
+    char *b;          // destination, or the other string for strcmp
+    long  n;
+    size_t (*strlen)(const char *s);
+    int    (*strcmp)(const char *a, const char *b);
+    void  *(*memchr)(const void *s, int c, size_t n);
+    void  *(*memcpy)(void *dst, const void *src, size_t n);
+    void  *(*memset)(void *dst, int c, size_t n);
+};
+
+static void run_strlen(void *p, long iters)
+{
+    struct str_arg *s = p;
+    for (long i = 0; i < iters; i++) sink += s->strlen(s->a);
+}
+
+static void run_strcmp(void *p, long iters)
+{
+    struct str_arg *s = p;
+    for (long i = 0; i < iters; i++) sink += s->strcmp(s->a, s->b);
+}
+
+static void run_memchr(void *p, long iters)
+{
+    struct str_arg *s = p;
+    for (long i = 0; i < iters; i++) sink += (long)s->memchr(s->a, 0, s->n);
+}
+
+static void run_memcpy(void *p, long iters)
+{
+    struct str_arg *s = p;
+    for (long i = 0; i < iters; i++) s->memcpy(s->b, s->a, s->n);
+}
+
+static void run_memset(void *p, long iters)
+{
+    struct str_arg *s = p;
+    for (long i = 0; i < iters; i++) s->memset(s->b, (int)i, s->n);
+}
+
+static char *append(char *p, const char *s)
+{
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+static char *append_dec(char *p, long n)
+{
+    char tmp[24];
+    int k = 0;
+    do tmp[k++] = '0' + n % 10; while (n /= 10);
+    while (k) *p++ = tmp[--k];
+    return p;
+}
+
+// "memcpy/avx2 4K", "memcpy/avx2 4K +17/+45" when misaligned
+static void name_size(char *dst, const char *fn, const char *variant, long n, int src, int dst_off)
+{
+    char *p = append(append(append(dst, fn), "/"), variant);
+    *p++ = ' ';
+
+    const char *unit = n >= 1024 ? "K" : "";
+    if (n >= 1024) n >>= 10;
+    p = append(append_dec(p, n), unit);
+    if (src || dst_off)
+    {
+        p = append_dec(append(p, " +"), src);
+        p = append_dec(append(p, "/+"), dst_off);
+    }
+    *p = 0;
+}
+
+static void suite_string(void)
+{
+    // aligned at three sizes, then the middle one with the source and
+    // destination (a and b for strcmp) off 64-byte alignment
+    static const struct { long n; int src, dst; } cases[] =
+    {
+        { 64, 0, 0 }, { 4096, 0, 0 }, { 256 * 1024, 0, 0 },
+        { 4096, 1, 0 }, { 4096, 0, 1 }, { 4096, 17, 45 }, { 4096, 63, 63 },
+    };
+    struct
+    {
+        const char *name;
+        int ok;
+        size_t (*strlen)(const char *s);
+        int    (*strcmp)(const char *a, const char *b);
+        void  *(*memchr)(const void *s, int c, size_t n);
+        void  *(*memcpy)(void *dst, const void *src, size_t n);
+        void  *(*memset)(void *dst, int c, size_t n);
+    } variants[] =
+    {
+        { "scalar", 1,            strlen_scalar, strcmp_scalar, memchr_scalar, memcpy_scalar, memset_scalar },
+        { "sse2",   1,            strlen_sse2,   strcmp_sse2,   memchr_sse2,   memcpy_sse2,   memset_sse2 },
+        { "avx2",   cpu.avx2,     strlen_avx2,   strcmp_avx2,   memchr_avx2,   memcpy_avx2,   memset_avx2 },
+        { "avx512", cpu.avx512bw, strlen_avx512, 0,             memchr_avx512, memcpy_avx512, memset_avx512 },
+    };
+
+    long max = 256 * 1024 + 128;    // room for the largest case at any offset
+    char *a = sys_mmap(0, 2 * max, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (SYS_MMAP_FAILED(a))
+    {
+        return;
+    }
+    char *b = a + max;
+
+    bench_suite("string");
+    for (unsigned v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+    {
+        if (!variants[v].ok) continue;
+        for (unsigned k = 0; k < sizeof(cases) / sizeof(cases[0]); k++)
+        {
+            long n = cases[k].n;
+            int src = cases[k].src;
+            int dst = cases[k].dst;
+            int aligned = !src && !dst;
+
+            struct str_arg arg = { a + src, b + dst, n, variants[v].strlen, variants[v].strcmp,
+                                   variants[v].memchr, variants[v].memcpy, variants[v].memset };
+            memset(arg.a, 'x', n);
+            arg.a[n] = 0;
+            memset(arg.b, 'x', n);
+            arg.b[n] = 0;
+
+            // the one-pointer functions only run where their pointer moved
+            char name[64];
+            if (aligned || src)
+            {
+                name_size(name, "strlen", variants[v].name, n, src, 0);
+                bench_run(0, name, run_strlen, &arg, n);
+            }
+            if (variants[v].strcmp)
+            {
+                name_size(name, "strcmp", variants[v].name, n, src, dst);
+                bench_run(0, name, run_strcmp, &arg, n);
+            }
+            if (aligned || src)
+            {
+                name_size(name, "memchr", variants[v].name, n, src, 0);
+                bench_run(0, name, run_memchr, &arg, n);
+            }
+            name_size(name, "memcpy", variants[v].name, n, src, dst);
+            bench_run(0, name, run_memcpy, &arg, n);
+            if (aligned || dst)
+            {
+                name_size(name, "memset", variants[v].name, n, 0, dst);
+                bench_run(0, name, run_memset, &arg, n);
+            }
+        }
+    }
+    sys_munmap(a, 2 * max);
+}
+
+// syscall
+
+struct io_arg
+{
+    int   fd;
+    char *buf;
+    long  n;
+};
+
+static void run_getpid(void *p, long iters)
+{
+    (void)p;
+    for (long i = 0; i < iters; i++) sink += sys_getpid();
+}
+
+static void run_clock_vdso(void *p, long iters)
+{
+    (void)p;
+    struct timespec ts;
+    for (long i = 0; i < iters; i++) { clock_gettime_fast(CLOCK_MONOTONIC, &ts); sink += ts.tv_nsec; }
+}
+
+static void run_clock_sys(void *p, long iters)
+{
+    (void)p;
+    struct timespec ts;
+    for (long i = 0; i < iters; i++) { sys_clock_gettime(CLOCK_MONOTONIC, &ts); sink += ts.tv_nsec; }
+}
+
+static void run_write(void *p, long iters)
+{
+    struct io_arg *a = p;
+    for (long i = 0; i < iters; i++) sink += sys_write(a->fd, a->buf, a->n);
+}
+
+static void run_read(void *p, long iters)
+{
+    struct io_arg *a = p;
+    for (long i = 0; i < iters; i++) sink += sys_read(a->fd, a->buf, a->n);
+}
+
+static void suite_syscall(void)
+{
+    static char buf[64 * 1024];
+
+    bench_suite("syscall");
+    bench_run(0, "getpid", run_getpid, 0, 0);
+    bench_run(0, "clock_gettime vdso", run_clock_vdso, 0, 0);
+    bench_run(0, "clock_gettime syscall", run_clock_sys, 0, 0);
+
+    struct io_arg a = { sys_open("/dev/null", O_WRONLY, 0), buf, 1 };
+    if (a.fd >= 0)
+    {
+        bench_run(0, "write /dev/null 1", run_write, &a, 1);
+        a.n = sizeof(buf);
+        bench_run(0, "write /dev/null 64K", run_write, &a, a.n);
+        sys_close(a.fd);
+    }
+
+    a.fd = sys_open("/dev/zero", O_RDONLY, 0);
+    if (a.fd >= 0)
+    {
+        a.n = sizeof(buf);
+        bench_run(0, "read /dev/zero 64K", run_read, &a, a.n);
+        sys_close(a.fd);
+    }
+}
+
+// tools
+
+#define CAT_FILE_SIZE (64L << 20)
+
+struct spawn_arg
+{
+    char *argv[4];
+    int   out;          // fd for the child's stdout
+};
+
+static void spawn(struct spawn_arg *s)
+{
+    long pid = sys_fork();
+    if (pid == 0)
+    {
+        sys_dup3(s->out, STDOUT, 0);
+        sys_execve(s->argv[0], s->argv, startup.envp);
+        sys_exit(127);
+    }
+    if (pid > 0)
+    {
+        int status;
+        while (sys_wait4(pid, &status, 0, 0) == -EINTR)
+            ;
+    }
+}
+
+static void run_spawn(void *p, long iters)
+{
+    for (long i = 0; i < iters; i++) spawn(p);
+}
+
+// "<dir of argv[0]>/<tool>"
+static void tool_path(char *dst, const char *self, const char *tool)
+{
+    long dir = 0;
+    for (long i = 0; self[i]; i++)
+    {
+        if (self[i] == '/') dir = i + 1;
+    }
+    memcpy(dst, self, dir);
+    long n = strlen(tool);
+    memcpy(dst + dir, tool, n + 1);
+}
+
+static void suite_tools(const char *self)
+{
+    static char cat[256], echo[256];
+    static char file[] = "/tmp/bench.cat.XXXXXXXX";
+    static char buf[1 << 20];
+
+    if (strlen(self) + 8 > sizeof(cat))
+    {
+        return;
+    }
+    tool_path(cat, self, "cat");
+    tool_path(echo, self, "echo");
+
+    // unique enough for one run at a time
+    unsigned long x = rdtsc();
+    for (int i = 0; i < 8; i++, x >>= 4) file[sizeof(file) - 9 + i] = "0123456789abcdef"[x & 15];
+
+    int fd = sys_open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        return;
+    }
+    memset(buf, 'x', sizeof(buf));
+    for (long done = 0; done < CAT_FILE_SIZE; done += sizeof(buf))
+    {
+        if (sys_write(fd, buf, sizeof(buf)) != sizeof(buf)) break;
+    }
+    sys_close(fd);
+
+    int null = sys_open("/dev/null", O_WRONLY, 0);
+    bench_suite("tools");
+
+    struct spawn_arg s = { { echo, "hello", 0 }, null };
+    bench_run(0, "echo hello", run_spawn, &s, 0);
+
+    s.argv[0] = cat;
+    s.argv[1] = file;
+    bench_run(0, "cat 64M > /dev/null", run_spawn, &s, CAT_FILE_SIZE);
+
+    // two files take the io_uring pipeline, which really moves the bytes
+    s.argv[2] = file;
+    bench_run(0, "cat 2x64M > /dev/null", run_spawn, &s, 2 * CAT_FILE_SIZE);
+
+    sys_close(null);
+    sys_unlink(file);
+}
+
+static int wanted(long argc, char **argv, const char *suite)
+{
+    if (argc < 2) return 1;
+    for (long i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], suite) == 0) return 1;
+    }
+    return 0;
+}
+
+long main_start(uintptr_t *rsp)
+{
+    long argc = (long)rsp[0];
+    char **argv = (char **)(rsp + 1);
+
+    bench_init();
+    if (wanted(argc, argv, "string"))  suite_string();
+    if (wanted(argc, argv, "syscall")) suite_syscall();
+    if (wanted(argc, argv, "tools"))   suite_tools(argv[0]);
+    return 0;
+}
@@ -7,8 +7,34 @@ then
     mkdir $BUILD_DIR
 fi
 
+# TRACE=1 ./tools/build.sh records every syscall, see trace.c
+CFLAGS=${CFLAGS:-"-g"}
+if [ -n "$TRACE" ];
+then
+    CFLAGS="$CFLAGS -DRT_TRACE"
+fi
+
+RUNTIME="./tools/runtime/start.c ./tools/runtime/arena.c ./tools/runtime/bench.c ./tools/runtime/auxv.c ./tools/runtime/coro.c ./tools/runtime/cpu.c ./tools/runtime/loop.c ./tools/runtime/out.c ./tools/runtime/perf.c ./tools/runtime/pool.c ./tools/runtime/ring.c ./tools/runtime/string.c ./tools/runtime/thread.c ./tools/runtime/trace.c ./tools/runtime/uring.c ./tools/runtime/vdso.c"
+
 # cat
-gcc -nostdlib -static -g -o "$BUILD_DIR/cat" ./tools/cat/cat.c ./tools/runtime/sys.c ./tools/runtime/start.c
+gcc -nostdlib -static $CFLAGS -o "$BUILD_DIR/cat" ./tools/cat/cat.c $RUNTIME
 
 #echo
-gcc -nostdlib -static -g -o "$BUILD_DIR/echo" ./tools/echo/echo.c ./tools/runtime/sys.c ./tools/runtime/start.c
+gcc -nostdlib -static $CFLAGS -o "$BUILD_DIR/echo" ./tools/echo/echo.c $RUNTIME
+
+# trace2json
+gcc -nostdlib -static -g -o "$BUILD_DIR/trace2json" ./tools/trace2json/trace2json.c $RUNTIME
+
+# check, "./tools/build.sh check" also runs it
+gcc -nostdlib -static $CFLAGS -o "$BUILD_DIR/check" ./tools/check/check.c $RUNTIME
+if [ "$1" = "check" ];
+then
+    "$BUILD_DIR/check"
+fi
+
+# bench, "./tools/build.sh bench" also runs it
+gcc -nostdlib -static $CFLAGS -o "$BUILD_DIR/bench" ./tools/bench/bench.c $RUNTIME
+if [ "$1" = "bench" ];
+then
+    "$BUILD_DIR/bench"
+fi
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Throughput of cat against --buffer-size, page-cache hot and cold.
+#
+#   ./tools/build.sh && ./tools/cat/bench.sh [total MiB] [files]
+#
+# The files are concatenated into /dev/null, which is the multi-file
+# io_uring path where the buffer size is the chunk size. Cold runs drop
+# the files from the page cache with dd iflag=nocache first, so they are
+# only truly cold on filesystems that honour it.
+
+CAT="./tools/build/cat"
+TOTAL_MB=${1:-256}
+FILES=${2:-8}
+SIZES="4K 16K 64K 128K 256K 512K 1M 2M 4M"
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+per_file=$((TOTAL_MB / FILES))
+i=0
+while [ $i -lt "$FILES" ];
+do
+    dd if=/dev/urandom of="$DIR/shard$i" bs=1M count=$per_file status=none
+    i=$((i + 1))
+done
+total=$((per_file * FILES))
+
+drop_cache() {
+    for f in "$DIR"/shard*; do
+        dd if="$f" iflag=nocache count=0 status=none
+    done
+}
+
+# prints MiB/s for one run
+run() {
+    t0=$(date +%s%N)
+    "$CAT" --buffer-size "$1" "$DIR"/shard* > /dev/null
+    t1=$(date +%s%N)
+    echo $((total * 1000000000 / (t1 - t0 + 1)))
+}
+
+printf "%d MiB in %d files\n\n" "$total" "$FILES"
+printf "%10s %12s %12s\n" "buffer" "hot MiB/s" "cold MiB/s"
+
+cat "$DIR"/shard* > /dev/null
+for size in $SIZES;
+do
+    hot=$(run "$size")
+    drop_cache
+    cold=$(run "$size")
+    cat "$DIR"/shard* > /dev/null
+    printf "%10s %12s %12s\n" "$size" "$hot" "$cold"
+done
@@ -1,40 +1,133 @@
 #include "../runtime/sys.h"
+#include "../runtime/uring.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-long main_start(uintptr_t *rsp)
+// most bytes we ask the kernel to move in one call
+#define CHUNK (1L << 30)
+
+// a copy routine returns this when the kernel won't do it for these fds
+#define REFUSED 1
+
+static int kernel_refused(long err)
 {
-    long argc = (long)rsp[0];
-    char **argv = (char **)(rsp + 1);
+    return err == -EINVAL || err == -ENOSYS || err == -EOPNOTSUPP;
+}
 
-    int fd = STDIN;
-    if (argc >= 2)
+// file -> file, in the kernel or as a reflink where the filesystem can
+static long copy_range(int in, int out)
+{
+    while (1)
     {
-        fd = sys_open(argv[1], O_RDONLY, 0);
-        if (fd < 0)
+        long n = sys_copy_file_range(in, 0, out, 0, CHUNK, 0);
+        if (n == 0) return 0;
+        if (n == -EINTR) continue;
+        if (n < 0)
         {
-            static const char err[] = "Could not open file\n";
-            sys_write(STDERR, err, sizeof(err)-1);
-            return 1;
+            // EXDEV: crossing filesystems on older kernels
+            // EBADF: stdout opened with O_APPEND (cat a >> b)
+            if (kernel_refused(n) || n == -EXDEV || n == -EBADF) return REFUSED;
+            return n;
         }
     }
+}
+
+// file -> anything, entirely in the kernel
+static long copy_sendfile(int in, int out)
+{
+    while (1)
+    {
+        long n = sys_sendfile(out, in, 0, CHUNK);
+        if (n == 0) return 0;
+        if (n == -EINTR) continue;
+        if (n < 0) return kernel_refused(n) ? REFUSED : n;
+    }
+}
+
+// pipe -> anything / anything -> pipe, entirely in the kernel
+static long copy_splice(int in, int out)
+{
+    while (1)
+    {
+        long n = sys_splice(in, 0, out, 0, CHUNK, SPLICE_F_MOVE);
+        if (n == 0) return 0;
+        if (n == -EINTR) continue;
+        if (n < 0) return kernel_refused(n) ? REFUSED : n;
+    }
+}
+
+// I/O strategy
+//
+// Buffers are sized from the file instead of a fixed 4 KiB: a whole
+// small file in one read, big files in MAX_BUF pieces, always a multiple
+// of st_blksize. --buffer-size overrides all of it.
+#define MIN_BUF (64 * 1024)
+#define MAX_BUF (4 * 1024 * 1024)
+
+static long opt_buffer_size;
 
-    if (fd < 0)
+static long round_up(long n, long to)
+{
+    return (n + to - 1) / to * to;
+}
+
+static long buffer_size(struct stat *st)
+{
+    if (opt_buffer_size)
     {
-        static const char err[] = "Unable to open file.";
+        return opt_buffer_size;
+    }
+
+    long blk = st && st->st_blksize > 0 ? st->st_blksize : 4096;
+    long size = MIN_BUF;
+    if (st && S_ISREG(st->st_mode) && st->st_size > size)
+    {
+        size = st->st_size < MAX_BUF ? st->st_size : MAX_BUF;
+    }
+    return round_up(size, blk);
+}
+
+// all I/O buffers come out of here, callers roll back to a mark when done
+static struct arena io_arena;
+
+static char *buffer_alloc(long size)
+{
+    return arena_alloc_aligned(&io_arena, size, 4096);
+}
+
+// Tell the kernel we'll read front to back and get the first window in
+// flight before we ask for it. Both are only hints, failures don't matter.
+static void read_hints(int fd, struct stat *st)
+{
+    if (!S_ISREG(st->st_mode))
+    {
+        return;
+    }
+    sys_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    sys_readahead(fd, 0, st->st_size < MAX_BUF ? st->st_size : MAX_BUF);
+}
+
+// the slow path: bounce every chunk through user space
+static long copy_rw(int in, struct out *out, struct stat *st)
+{
+    long s = buffer_size(st);
+    struct arena_mark mark = arena_mark(&io_arena);
+    char *buffer = buffer_alloc(s);
+    if (!buffer)
+    {
+        static const char err[] = "could not allocate buffer\n";
         sys_write(STDERR, err, sizeof(err)-1);
         return 1;
     }
 
-    // read from file
-    long s = 4096;
-    const char buffer[s];
-
-    long done = 0;
+    long ret = 0;
     while (1)
     {
-        int n = sys_read(fd, buffer, s);
+        long n = sys_read(in, buffer, s);
         if (n == 0)
         {
             break;
@@ -44,13 +137,601 @@ long main_start(uintptr_t *rsp)
         {
            static const char err[] = "error reading\n";
            sys_write(STDERR, err, sizeof(err)-1);
-           return n;
+           ret = n;
+           break;
         }
-        // static const char msg[] = "foo bar test\n";
-        sys_write(STDOUT, buffer, n);
+        // flushed every time round so a tty on the other end sees each line
+        out_write(out, buffer, n);
+        if (out_flush(out) < 0)
+        {
+            ret = out->err;
+            break;
+        }
+    }
 
-        done += n;
+    arena_rollback(&io_arena, mark);
+    return ret;
+}
+
+// Regular files too big to be worth a bounce buffer are mapped a window
+// at a time and written straight out of the page cache. Each window is
+// unmapped as soon as it's written so the mapping never grows past one.
+#define MMAP_MIN     (1L << 20)
+#define MMAP_WINDOW  (16L << 20)
+#define PAGE_SIZE    4096L
+
+static long copy_mmap(int in, struct out *out, struct stat *st)
+{
+    // carry on from wherever the fd is, a faster path may have moved it
+    long pos = sys_lseek(in, 0, SEEK_CUR);
+    if (pos < 0)
+    {
+        return REFUSED;
+    }
+
+    while (pos < st->st_size)
+    {
+        long start = pos & ~(PAGE_SIZE - 1);
+        long len = st->st_size - start;
+        if (len > MMAP_WINDOW) len = MMAP_WINDOW;
+
+        char *map = sys_mmap(0, len, PROT_READ, MAP_PRIVATE, in, start);
+        if (SYS_MMAP_FAILED(map))
+        {
+            return REFUSED;
+        }
+        // advice values aren't flags, so it takes two calls
+        sys_madvise(map, len, MADV_SEQUENTIAL);
+        sys_madvise(map, len, MADV_WILLNEED);
+
+        long ret = out_write(out, map + (pos - start), len - (pos - start));
+        sys_munmap(map, len);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        pos = start + len;
+        sys_lseek(in, pos, SEEK_SET);
     }
 
     return 0;
 }
+
+// Pick the cheapest way the kernel offers to move in -> out. The fast
+// paths use the fds' own offsets, so if the kernel refuses part way
+// through the next path carries on from where the last one stopped.
+static long transfer(int in, struct out *out)
+{
+    struct stat in_st, out_st;
+    struct stat *in_known = 0;
+    int in_reg = 0, in_pipe = 0, out_reg = 0, out_pipe = 0;
+
+    if (sys_fstat(in, &in_st) == 0)
+    {
+        in_known = &in_st;
+        in_reg  = S_ISREG(in_st.st_mode);
+        in_pipe = S_ISFIFO(in_st.st_mode);
+        read_hints(in, &in_st);
+    }
+    if (sys_fstat(out->fd, &out_st) == 0)
+    {
+        out_reg  = S_ISREG(out_st.st_mode);
+        out_pipe = S_ISFIFO(out_st.st_mode);
+    }
+
+    long ret = REFUSED;
+    if (in_reg && out_reg)
+    {
+        ret = copy_range(in, out->fd);
+    }
+    if (ret == REFUSED && in_reg)
+    {
+        ret = copy_sendfile(in, out->fd);
+    }
+    if (ret == REFUSED && (in_pipe || out_pipe))
+    {
+        ret = copy_splice(in, out->fd);
+    }
+    if (ret == REFUSED && in_reg && in_st.st_size >= MMAP_MIN)
+    {
+        ret = copy_mmap(in, out, &in_st);
+    }
+    if (ret == REFUSED)
+    {
+        return copy_rw(in, out, in_known);
+    }
+
+    if (ret < 0)
+    {
+        static const char err[] = "error copying\n";
+        sys_write(STDERR, err, sizeof(err)-1);
+    }
+    return ret;
+}
+
+// Multi-file pipeline
+//
+// Every input file is cut into slot-sized chunks numbered in output order.
+// Chunk n always lives in slot n % NUM_SLOTS, so up to NUM_SLOTS reads
+// can be in flight (across as many files as that spans) while the
+// oldest chunk is being written. Only one write is in flight at a time,
+// that's what keeps the output in order.
+//
+// A failed read drops the rest of that file and the pipeline moves on to
+// the next one. A failed write stops it, but not before every request
+// still in flight has completed, since the kernel owns those buffers.
+#define NUM_SLOTS  16
+#define SLOT_SIZE  (128 * 1024)   // unless --buffer-size says otherwise
+#define WRITE_BIT  (1UL << 63)
+
+enum { SLOT_FREE, SLOT_READING, SLOT_READY, SLOT_WRITING };
+
+struct slot
+{
+    int   state;
+    int   fd;
+    int   last;       // last chunk of its file, close fd once written
+    int   failed;     // its file had a read error, write nothing
+    char *path;
+    long  len;        // bytes read
+    long  done;       // bytes written so far
+    char *buf;
+};
+
+struct pipeline
+{
+    struct uring ring;
+    struct slot  slots[NUM_SLOTS];
+    struct out *out;
+    int   status;
+
+    long  slot_size;
+
+    char **files;
+    long  nfiles;
+    long  next_file;
+
+    int   fd;          // file currently being cut into chunks, or -1
+    char *path;
+    long  size;
+    long  off;
+    int   stream;      // non-regular file waiting for the pipeline to drain, or -1
+
+    unsigned long next_read;    // next chunk to schedule
+    unsigned long next_write;   // oldest chunk not yet written
+    int   writing;
+    int   inflight;    // requests the kernel hasn't completed yet
+};
+
+static void pipeline_error(struct pipeline *p, const char *msg, long len)
+{
+    sys_write(STDERR, msg, len);
+    p->status = 1;
+}
+
+static void file_error(struct pipeline *p, const char *msg, char *path)
+{
+    struct iovec iov[3] = {
+        { (void *)msg, strlen(msg) },
+        { path, strlen(path) },
+        { "\n", 1 },
+    };
+    sys_writev(STDERR, iov, 3);
+    p->status = 1;
+}
+
+// Open the next file on the command line. Regular files become the
+// current chunk source, anything else (pipes, ttys, ...) is parked until
+// everything before it has been written.
+static void open_next(struct pipeline *p)
+{
+    while (p->next_file < p->nfiles && p->fd < 0 && p->stream < 0)
+    {
+        char *path = p->files[p->next_file++];
+        int fd = sys_open(path, O_RDONLY, 0);
+        if (fd < 0)
+        {
+            static const char err[] = "Could not open file\n";
+            pipeline_error(p, err, sizeof(err)-1);
+            continue;
+        }
+
+        // /proc and friends claim to be empty regular files, so
+        // anything without a size is read as a stream as well
+        struct stat st;
+        if (sys_fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        {
+            p->stream = fd;
+            break;
+        }
+
+        read_hints(fd, &st);
+        p->fd   = fd;
+        p->path = path;
+        p->size = st.st_size;
+        p->off  = 0;
+    }
+}
+
+static void schedule_reads(struct pipeline *p)
+{
+    while (p->next_read - p->next_write < NUM_SLOTS)
+    {
+        open_next(p);
+        if (p->fd < 0)
+        {
+            return;
+        }
+
+        struct io_uring_sqe *sqe = uring_get_sqe(&p->ring);
+        if (!sqe)
+        {
+            return;
+        }
+
+        struct slot *s = &p->slots[p->next_read % NUM_SLOTS];
+        long len = p->size - p->off;
+        if (len > p->slot_size) len = p->slot_size;
+
+        s->state = SLOT_READING;
+        s->fd     = p->fd;
+        s->path   = p->path;
+        s->len    = 0;
+        s->done   = 0;
+        s->failed = 0;
+        s->last   = p->off + len >= p->size;
+        uring_prep_read(sqe, p->fd, s->buf, len, p->off, p->next_read);
+        p->inflight++;
+
+        p->off += len;
+        p->next_read++;
+        if (s->last)
+        {
+            p->fd = -1;
+        }
+    }
+}
+
+static void schedule_write(struct pipeline *p)
+{
+    if (p->writing || p->next_write == p->next_read)
+    {
+        return;
+    }
+
+    struct slot *s = &p->slots[p->next_write % NUM_SLOTS];
+    if (s->state != SLOT_READY)
+    {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&p->ring);
+    if (!sqe)
+    {
+        return;
+    }
+
+    s->state = SLOT_WRITING;
+    p->writing = 1;
+    uring_prep_write(sqe, p->out->fd, s->buf + s->done, s->len - s->done, -1, p->next_write | WRITE_BIT);
+    p->inflight++;
+}
+
+static void chunk_written(struct pipeline *p, struct slot *s)
+{
+    if (s->last)
+    {
+        sys_close(s->fd);
+    }
+    s->state = SLOT_FREE;
+    p->next_write++;
+}
+
+// A read of s failed: report its file and drop whatever of it hasn't
+// gone out yet. Its chunks still being read complete as empty ones, and
+// if it's still being cut up the last chunk handed out closes it.
+static void read_failed(struct pipeline *p, struct slot *s)
+{
+    file_error(p, "error reading ", s->path);
+
+    int fd = s->fd;
+    for (unsigned long chunk = p->next_write; chunk != p->next_read; chunk++)
+    {
+        struct slot *c = &p->slots[chunk % NUM_SLOTS];
+        if (c->fd != fd || c->state == SLOT_WRITING) continue;
+        c->failed = 1;
+        if (c->state == SLOT_READY) c->len = 0;
+    }
+    if (p->fd == fd)
+    {
+        p->slots[(p->next_read - 1) % NUM_SLOTS].last = 1;
+        p->fd = -1;
+    }
+}
+
+static long complete(struct pipeline *p, struct io_uring_cqe *cqe)
+{
+    unsigned long chunk = cqe->user_data & ~WRITE_BIT;
+    struct slot *s = &p->slots[chunk % NUM_SLOTS];
+    long res = cqe->res;
+
+    if (cqe->user_data & WRITE_BIT)
+    {
+        p->writing = 0;
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            s->state = SLOT_READY;   // resubmitted on the next pass
+            return 0;
+        }
+        if (res < 0)
+        {
+            static const char err[] = "error writing\n";
+            pipeline_error(p, err, sizeof(err)-1);
+            return res;
+        }
+
+        s->done += res;
+        if (s->done < s->len)
+        {
+            s->state = SLOT_READY;   // short write, send the rest
+        }
+        else
+        {
+            chunk_written(p, s);
+        }
+        return 0;
+    }
+
+    s->state = SLOT_READY;
+    if (s->failed)
+    {
+        return 0;
+    }
+    if (res < 0)
+    {
+        read_failed(p, s);
+        return 0;
+    }
+
+    // a short read means the file shrank under us, write what we got
+    s->len = res;
+    return 0;
+}
+
+// Wait for everything still in flight so the slot buffers can be reused.
+// Fails only when io_uring itself does, and then they can't be.
+static long pipeline_drain(struct pipeline *p)
+{
+    while (p->inflight > 0)
+    {
+        long ret = uring_submit(&p->ring, 1);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&p->ring)))
+        {
+            p->inflight--;
+            uring_cqe_seen(&p->ring);
+        }
+    }
+    return 0;
+}
+
+static long pipeline_run(struct pipeline *p)
+{
+    while (1)
+    {
+        schedule_reads(p);
+
+        // empty chunks (truncated files) have nothing to write
+        while (p->next_write != p->next_read && !p->writing)
+        {
+            struct slot *s = &p->slots[p->next_write % NUM_SLOTS];
+            if (s->state != SLOT_READY || s->len != 0) break;
+            chunk_written(p, s);
+        }
+        schedule_write(p);
+
+        if (p->next_write == p->next_read)
+        {
+            if (p->stream >= 0)
+            {
+                // everything before it is out, let the normal engine take it
+                long ret = transfer(p->stream, p->out);
+                sys_close(p->stream);
+                p->stream = -1;
+                if (ret < 0) return ret;
+                continue;
+            }
+            if (p->fd < 0 && p->next_file >= p->nfiles)
+            {
+                return 0;
+            }
+        }
+
+        long ret = uring_submit(&p->ring, 1);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&p->ring)))
+        {
+            p->inflight--;
+            ret = complete(p, cqe);
+            uring_cqe_seen(&p->ring);
+            if (ret < 0) return ret;
+        }
+    }
+}
+
+// Returns 0 without touching any file when io_uring isn't available so
+// the caller can fall back to one transfer() per file.
+static int cat_files(char **files, long nfiles, struct out *out, long *ret)
+{
+    static struct pipeline p;
+
+    if (uring_init(&p.ring, 2 * NUM_SLOTS) < 0)
+    {
+        return 0;
+    }
+
+    p.slot_size = opt_buffer_size ? opt_buffer_size : SLOT_SIZE;
+    struct arena_mark mark = arena_mark(&io_arena);
+    char *bufs = buffer_alloc(NUM_SLOTS * p.slot_size);
+    if (!bufs)
+    {
+        uring_free(&p.ring);
+        return 0;
+    }
+    for (int i = 0; i < NUM_SLOTS; i++)
+    {
+        p.slots[i].state = SLOT_FREE;
+        p.slots[i].buf = bufs + i * p.slot_size;
+    }
+
+    p.out    = out;
+    p.files  = files;
+    p.nfiles = nfiles;
+    p.fd     = -1;
+    p.stream = -1;
+
+    TRACE_SPAN_BEGIN(span);
+    *ret = pipeline_run(&p);
+    TRACE_SPAN_END(span, "pipeline");
+    if (*ret == 0) *ret = p.status;
+
+    // after an error reads may still be landing in the buffers
+    if (pipeline_drain(&p) == 0)
+    {
+        arena_rollback(&io_arena, mark);
+    }
+    uring_free(&p.ring);
+    return 1;
+}
+
+// "64K", "4M", "1048576"
+static long parse_size(const char *s)
+{
+    long n = 0;
+    if (!*s) return -1;
+    for (; *s >= '0' && *s <= '9'; s++)
+    {
+        n = n * 10 + (*s - '0');
+        if (n > (1L << 40)) return -1;
+    }
+    if (*s == 'k' || *s == 'K')      { n <<= 10; s++; }
+    else if (*s == 'm' || *s == 'M') { n <<= 20; s++; }
+    return *s ? -1 : n;
+}
+
+static int opt_perf_stats;
+
+// Pull our options out of argv, leaving only the paths behind.
+// Returns the new argc or -1 on a bad option.
+static long parse_options(long argc, char **argv)
+{
+    static const char opt[] = "--buffer-size";
+    long out = 1;
+
+    for (long i = 1; i < argc; i++)
+    {
+        const char *a = argv[i];
+        if (strcmp(a, "--perf-stats") == 0)
+        {
+            opt_perf_stats = 1;
+            continue;
+        }
+
+        long k = 0;
+        while (k < (long)sizeof(opt)-1 && a[k] == opt[k]) k++;
+        if (k < (long)sizeof(opt)-1 || (a[k] != '=' && a[k] != '\0'))
+        {
+            argv[out++] = argv[i];
+            continue;
+        }
+
+        const char *val = a[k] == '=' ? a + k + 1 : (i + 1 < argc ? argv[++i] : "");
+        opt_buffer_size = parse_size(val);
+        if (opt_buffer_size <= 0)
+        {
+            static const char err[] = "invalid --buffer-size\n";
+            sys_write(STDERR, err, sizeof(err)-1);
+            return -1;
+        }
+    }
+
+    return out;
+}
+
+long main_start(uintptr_t *rsp)
+{
+    long argc = (long)rsp[0];
+    char **argv = (char **)(rsp + 1);
+
+    static char out_buf[4096];
+    static struct out out;
+    out_init(&out, STDOUT, out_buf, sizeof(out_buf));
+    arena_init(&io_arena, MAX_BUF, ARENA_HUGEPAGE);
+
+    argc = parse_options(argc, argv);
+    if (argc < 0)
+    {
+        return 1;
+    }
+    if (opt_perf_stats || env_flag("PERF_STATS"))
+    {
+        perf_open();
+        perf_phase("setup");
+    }
+
+    if (argc < 2)
+    {
+        perf_phase("copy");
+        return transfer(STDIN, &out);
+    }
+
+    // Several files into something that isn't a regular file: pipeline
+    // them through io_uring. Into a regular file copy_file_range per file
+    // already beats anything we could do from user space.
+    struct stat out_st;
+    int out_reg = sys_fstat(STDOUT, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    perf_phase("copy");
+    if (argc > 2 && !out_reg)
+    {
+        long ret;
+        if (cat_files(argv + 1, argc - 1, &out, &ret))
+        {
+            return ret;
+        }
+    }
+
+    int status = 0;
+    for (long i = 1; i < argc; i++)
+    {
+        int fd = sys_open(argv[i], O_RDONLY, 0);
+        if (fd < 0)
+        {
+            static const char err[] = "Could not open file\n";
+            sys_write(STDERR, err, sizeof(err)-1);
+            status = 1;
+            continue;
+        }
+
+        TRACE_SPAN_BEGIN(span);
+        long ret = transfer(fd, &out);
+        TRACE_SPAN_END(span, argv[i]);
+        sys_close(fd);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,480 @@
+// check
+//
+// Correctness checks for the runtime's string kernels and output
+// streams:
+//
+//   ./tools/build.sh check
+//
+// Every _scalar/_sse2/_avx2/_avx512 variant the CPU can run is checked
+// against known answers for every length up to MAX_LEN at every
+// alignment mod 64, and again with the buffers ending on the last byte
+// before a PROT_NONE page, where an over-read that leaves the page
+// faults. memmove has no variants of its own, it is checked on top of
+// each memcpy. Failures are printed and the exit status is 1 if there
+// were any.
+#include "../runtime/sys.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define PAGE     4096L
+#define ALIGN    64
+#define MAX_LEN  320      // a few of the widest vectors past every head/tail split
+#define MARGIN   64       // bytes either side of a destination that must not change
+#define MAX_FAIL 50       // failures printed, the rest are only counted
+
+struct variant
+{
+    const char *name;
+    int ok;
+    size_t (*strlen)(const char *s);
+    int    (*strcmp)(const char *a, const char *b);    // 0 where there's none
+    void  *(*memchr)(const void *s, int c, size_t n);
+    void  *(*memcpy)(void *dst, const void *src, size_t n);
+    void  *(*memset)(void *dst, int c, size_t n);
+};
+
+static char out_buf[4096];
+static struct out out;
+
+static const char *cur_fn;
+static const char *cur_variant;
+static long checks;
+static long failures;
+
+static void expect(int ok, const char *what, long len, long align_a, long align_b)
+{
+    checks++;
+    if (ok || failures++ >= MAX_FAIL)
+    {
+        return;
+    }
+    out_str(&out, "FAIL ");
+    out_str(&out, cur_fn);
+    out_str(&out, "/");
+    out_str(&out, cur_variant);
+    out_str(&out, ": ");
+    out_str(&out, what);
+    out_str(&out, ", len ");
+    out_dec(&out, len, 0);
+    out_str(&out, ", align ");
+    out_dec(&out, align_a, 0);
+    out_str(&out, "/");
+    out_dec(&out, align_b, 0);
+    out_str(&out, "\n");
+    out_flush(&out);    // in case a later check faults
+}
+
+// Two read-write pages followed by a PROT_NONE one. Returns the start of
+// the guard page, so a buffer placed at end - n ends right before it.
+static char *guarded(void)
+{
+    char *map = sys_mmap(0, 3 * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (SYS_MMAP_FAILED(map))
+    {
+        return 0;
+    }
+    sys_mprotect(map + 2 * PAGE, PAGE, PROT_NONE);
+    return map + 2 * PAGE;
+}
+
+// The byte the pattern has at address p: odd, so never 0 or NEEDLE, and
+// with the high bit set half the time to catch signed compares. It's a
+// function of the address so any byte can be checked without a copy.
+#define NEEDLE 0xe8
+
+static char pattern(const char *p)
+{
+    return (char)((uintptr_t)p * 7 | 1);
+}
+
+static void fill(char *p, long n)
+{
+    for (long i = 0; i < n; i++) p[i] = pattern(p + i);
+}
+
+static long align(const void *p)
+{
+    return (uintptr_t)p & (ALIGN - 1);
+}
+
+// Lengths for the grids that multiply out alignments or shifts: all of
+// them up to two of the widest vectors, then every 7th, which still
+// lands on a different tail length each time.
+static long next_len(long len)
+{
+    return len < 2 * ALIGN ? len + 1 : len + 7;
+}
+
+// strlen
+
+static void check_strlen(const struct variant *v, char *end)
+{
+    char *base = end - 2 * PAGE;
+    fill(base, 2 * PAGE);
+
+    for (long a = 0; a < ALIGN; a++)
+    {
+        for (long len = 0; len <= MAX_LEN; len++)
+        {
+            char *s = base + a;
+            s[len] = 0;
+            expect(v->strlen(s) == (size_t)len, "length", len, a, 0);
+            s[len] = pattern(s + len);
+        }
+    }
+
+    for (long len = 0; len <= MAX_LEN; len++)
+    {
+        char *s = end - len - 1;
+        s[len] = 0;
+        expect(v->strlen(s) == (size_t)len, "length at page end", len, align(s), 0);
+        s[len] = pattern(s + len);
+    }
+}
+
+// strcmp
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+// give b the len bytes of pattern a holds and compare them as they are,
+// with a difference in the last byte (unsigned, so 0x01 < 0xff) and with
+// b cut short halfway
+static void strcmp_cases(const struct variant *v, char *a, char *b, long len, const char *where)
+{
+    for (long i = 0; i < len; i++) b[i] = pattern(a + i);
+    a[len] = 0;
+    b[len] = 0;
+    expect(v->strcmp(a, b) == 0, where, len, align(a), align(b));
+
+    if (len > 0)
+    {
+        char sa = a[len - 1];
+        char sb = b[len - 1];
+        a[len - 1] = 0x01;
+        b[len - 1] = (char)0xff;
+        expect(sign(v->strcmp(a, b)) == -1, where, len, align(a), align(b));
+        expect(sign(v->strcmp(b, a)) == 1, where, len, align(a), align(b));
+        a[len - 1] = sa;
+        b[len - 1] = sb;
+
+        char half = b[len / 2];
+        b[len / 2] = 0;
+        expect(sign(v->strcmp(a, b)) == 1, where, len, align(a), align(b));
+        expect(sign(v->strcmp(b, a)) == -1, where, len, align(a), align(b));
+        b[len / 2] = half;
+    }
+    a[len] = pattern(a + len);
+}
+
+static void check_strcmp(const struct variant *v, char *end_a, char *end_b)
+{
+    char *base_a = end_a - 2 * PAGE;
+    char *base_b = end_b - 2 * PAGE;
+    fill(base_a, 2 * PAGE);
+
+    for (long a = 0; a < ALIGN; a++)
+    {
+        for (long b = 0; b < ALIGN; b++)
+        {
+            for (long len = 0; len <= MAX_LEN; len = next_len(len))
+            {
+                strcmp_cases(v, base_a + a, base_b + b, len, "compare");
+            }
+        }
+    }
+
+    // one or both strings ending right before a guard page
+    for (long len = 0; len <= MAX_LEN; len++)
+    {
+        for (long b = 0; b < ALIGN; b++)
+        {
+            strcmp_cases(v, end_a - len - 1, base_b + b, len, "compare at page end");
+            strcmp_cases(v, base_a + b, end_b - len - 1, len, "compare at page end");
+        }
+        strcmp_cases(v, end_a - len - 1, end_b - len - 1, len, "compare at page end");
+    }
+}
+
+// memchr
+
+static void memchr_cases(const struct variant *v, char *s, long len, const char *where)
+{
+    expect(v->memchr(s, NEEDLE, len) == 0, where, len, align(s), 0);
+
+    long at[] = { 0, len / 2, len - 1 };
+    for (unsigned i = 0; i < sizeof(at) / sizeof(at[0]) && len > 0; i++)
+    {
+        s[at[i]] = (char)NEEDLE;
+        expect(v->memchr(s, NEEDLE, len) == s + at[i], where, len, align(s), 0);
+        // only the low byte of c counts
+        expect(v->memchr(s, NEEDLE | ~0xff, len) == s + at[i], where, len, align(s), 0);
+        s[at[i]] = pattern(s + at[i]);
+    }
+}
+
+static void check_memchr(const struct variant *v, char *end)
+{
+    char *base = end - 2 * PAGE;
+    fill(base, 2 * PAGE);
+
+    for (long a = 0; a < ALIGN; a++)
+    {
+        for (long len = 0; len <= MAX_LEN; len++)
+        {
+            char *s = base + a;
+            // a match right past the end doesn't count
+            s[len] = (char)NEEDLE;
+            memchr_cases(v, s, len, "search");
+            s[len] = pattern(s + len);
+        }
+    }
+
+    for (long len = 0; len <= MAX_LEN; len++)
+    {
+        memchr_cases(v, end - len, len, "search at page end");
+    }
+}
+
+// memcpy, memset
+
+// [lo, d) and [d + len, hi) still hold the pattern
+static int untouched(const char *lo, const char *hi, const char *d, long len)
+{
+    for (const char *p = lo; p < d; p++)
+    {
+        if (*p != pattern(p)) return 0;
+    }
+    for (const char *p = d + len; p < hi; p++)
+    {
+        if (*p != pattern(p)) return 0;
+    }
+    return 1;
+}
+
+// copy from s to d, which are far apart, and check d against s
+static void memcpy_case(const struct variant *v, char *d, const char *s, long len, const char *lo, const char *hi, const char *where)
+{
+    int ok = v->memcpy(d, s, len) == d;
+    for (long i = 0; i < len; i++)
+    {
+        if (d[i] != pattern(s + i)) ok = 0;
+    }
+    expect(ok && untouched(lo, hi, d, len), where, len, align(d), align(s));
+    fill(d, len);
+}
+
+static void check_memcpy(const struct variant *v, char *end_d, char *end_s)
+{
+    char *base_d = end_d - 2 * PAGE;
+    char *base_s = end_s - 2 * PAGE;
+    fill(base_d, 2 * PAGE);
+    fill(base_s, 2 * PAGE);
+
+    for (long a = 0; a < ALIGN; a++)
+    {
+        for (long b = 0; b < ALIGN; b++)
+        {
+            char *d = base_d + MARGIN + a;
+            for (long len = 0; len <= MAX_LEN; len = next_len(len))
+            {
+                memcpy_case(v, d, base_s + b, len, d - MARGIN, d + len + MARGIN, "copy");
+            }
+        }
+    }
+
+    for (long len = 0; len <= MAX_LEN; len++)
+    {
+        char *d = end_d - len;
+        memcpy_case(v, d, end_s - len, len, d - MARGIN, end_d, "copy at page end");
+        for (long b = 0; b < ALIGN; b++)
+        {
+            memcpy_case(v, base_d + MARGIN + b, end_s - len, len, base_d + b, base_d + 2 * MARGIN + b + len, "copy at page end");
+        }
+    }
+}
+
+static void memset_case(const struct variant *v, char *d, long len, const char *hi, const char *where)
+{
+    // only the low byte of c counts
+    int ok = v->memset(d, 0x1a5, len) == d;
+    for (long i = 0; i < len; i++)
+    {
+        if (d[i] != (char)0xa5) ok = 0;
+    }
+    expect(ok && untouched(d - MARGIN, hi, d, len), where, len, align(d), 0);
+    fill(d, len);
+}
+
+static void check_memset(const struct variant *v, char *end)
+{
+    char *base = end - 2 * PAGE;
+    fill(base, 2 * PAGE);
+
+    for (long a = 0; a < ALIGN; a++)
+    {
+        for (long len = 0; len <= MAX_LEN; len++)
+        {
+            char *d = base + MARGIN + a;
+            memset_case(v, d, len, d + len + MARGIN, "set");
+        }
+    }
+
+    for (long len = 0; len <= MAX_LEN; len++)
+    {
+        memset_case(v, end - len, len, end, "set at page end");
+    }
+}
+
+// memmove
+
+// move len bytes from s to s + shift within one patterned buffer
+static void memmove_case(char *s, long shift, long len)
+{
+    char *d = s + shift;
+    char *lo = (shift < 0 ? d : s) - MARGIN;
+    char *hi = (shift < 0 ? s : d) + len + MARGIN;
+
+    int ok = memmove(d, s, len) == d;
+    for (long i = 0; i < len; i++)
+    {
+        if (d[i] != pattern(s + i)) ok = 0;
+    }
+    expect(ok && untouched(lo, hi, d, len), "move", len, align(d), align(s));
+    fill(lo, hi - lo);
+}
+
+// memmove copies through kernels.memcpy unless dst is ahead of src and
+// overlapping, so point that at the variant for the duration
+static void check_memmove(const struct variant *v, char *end)
+{
+    static const long shifts[] = { -65, -64, -33, -32, -31, -17, -16, -15, -1, 0, 1, 15, 16, 17, 31, 32, 33, 64, 65 };
+    char *base = end - 2 * PAGE;
+    fill(base, 2 * PAGE);
+
+    void *(*saved)(void *dst, const void *src, size_t n) = kernels.memcpy;
+    kernels.memcpy = v->memcpy;
+    for (long a = 0; a < ALIGN; a++)
+    {
+        for (long len = 0; len <= MAX_LEN; len = next_len(len))
+        {
+            for (unsigned k = 0; k < sizeof(shifts) / sizeof(shifts[0]); k++)
+            {
+                memmove_case(base + 3 * MARGIN + a, shifts[k], len);
+            }
+        }
+    }
+    kernels.memcpy = saved;
+}
+
+// out
+
+// Zero-length writes queue nothing: a stream that only got those
+// flushes cleanly instead of calling an empty writev a failure, and
+// they leave the bytes around them alone.
+static void check_out(void)
+{
+    cur_fn = "out";
+    cur_variant = "empty";
+    long before = failures;
+
+    int fds[2];
+    if (sys_pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        expect(0, "pipe", 0, 0, 0);
+        return;
+    }
+    static char buf[64];
+    static struct out o;
+    out_init(&o, fds[1], buf, sizeof(buf));
+
+    out_write(&o, "", 0);
+    out_ref(&o, "", 0);
+    out_str(&o, "");
+    expect(out_flush(&o) == 0, "flush of empty writes", 0, 0, 0);
+
+    out_write(&o, "ab", 2);
+    out_ref(&o, "", 0);
+    out_write(&o, "cd", 2);
+    expect(out_flush(&o) == 0, "flush around empty writes", 4, 0, 0);
+
+    char got[8];
+    long n = sys_read(fds[0], got, sizeof(got));
+    expect(n == 4 && got[0] == 'a' && got[1] == 'b' && got[2] == 'c' && got[3] == 'd', "bytes around empty writes", n, 0, 0);
+
+    sys_close(fds[0]);
+    sys_close(fds[1]);
+    out_str(&out, failures == before ? "out/empty: ok\n" : "out/empty: FAILED\n");
+    out_flush(&out);
+}
+
+static void run(const struct variant *v, const char *fn, void (*check)(const struct variant *v, char *a, char *b), char *a, char *b)
+{
+    cur_fn = fn;
+    cur_variant = v->name;
+    long before = failures;
+    check(v, a, b);
+
+    out_str(&out, fn);
+    out_str(&out, "/");
+    out_str(&out, v->name);
+    out_str(&out, failures == before ? ": ok\n" : ": FAILED\n");
+    out_flush(&out);
+}
+
+// the single-buffer checks ignore the second one
+static void one_strlen(const struct variant *v, char *a, char *b)  { (void)b; check_strlen(v, a); }
+static void one_memchr(const struct variant *v, char *a, char *b)  { (void)b; check_memchr(v, a); }
+static void one_memset(const struct variant *v, char *a, char *b)  { (void)b; check_memset(v, a); }
+static void one_memmove(const struct variant *v, char *a, char *b) { (void)b; check_memmove(v, a); }
+
+long main_start(uintptr_t *rsp)
+{
+    (void)rsp;
+    out_init(&out, STDOUT, out_buf, sizeof(out_buf));
+
+    struct variant variants[] =
+    {
+        { "scalar", 1,            strlen_scalar, strcmp_scalar, memchr_scalar, memcpy_scalar, memset_scalar },
+        { "sse2",   1,            strlen_sse2,   strcmp_sse2,   memchr_sse2,   memcpy_sse2,   memset_sse2 },
+        { "avx2",   cpu.avx2,     strlen_avx2,   strcmp_avx2,   memchr_avx2,   memcpy_avx2,   memset_avx2 },
+        { "avx512", cpu.avx512bw, strlen_avx512, 0,             memchr_avx512, memcpy_avx512, memset_avx512 },
+    };
+
+    char *a = guarded();
+    char *b = guarded();
+    if (!a || !b)
+    {
+        static const char err[] = "could not map the test buffers\n";
+        sys_write(STDERR, err, sizeof(err)-1);
+        return 1;
+    }
+
+    check_out();
+    for (unsigned i = 0; i < sizeof(variants) / sizeof(variants[0]); i++)
+    {
+        const struct variant *v = &variants[i];
+        if (!v->ok)
+        {
+            out_str(&out, v->name);
+            out_str(&out, ": not supported here, skipped\n");
+            continue;
+        }
+        run(v, "strlen", one_strlen, a, b);
+        if (v->strcmp) run(v, "strcmp", check_strcmp, a, b);
+        run(v, "memchr", one_memchr, a, b);
+        run(v, "memcpy", check_memcpy, a, b);
+        run(v, "memset", one_memset, a, b);
+        run(v, "memmove", one_memmove, a, b);
+    }
+
+    out_dec(&out, checks, 0);
+    out_str(&out, " checks, ");
+    out_dec(&out, failures, 0);
+    out_str(&out, " failed\n");
+    return failures ? 1 : 0;
+}
@@ -7,53 +7,71 @@ long main_start(uintptr_t *rsp)
     long argc = (long)rsp[0];
     char **argv = (char **)(rsp + 1);
 
+    // argv lives until exit, so the arguments are queued by reference and
+    // the whole line goes out in a single writev
+    static char buf[4096];
+    static struct out out;
+    out_init(&out, STDOUT, buf, sizeof(buf));
+
+    // --perf-stats is only an option among the leading arguments; past the
+    // first word it is printed like any other
+    int perf_stats = env_flag("PERF_STATS");
+    int opts = 1;
+    for (; opts < argc; opts++)
+    {
+        if (strcmp(argv[opts], "--perf-stats") == 0) perf_stats = 1;
+        else if (strcmp(argv[opts], "-n") != 0) break;
+    }
+    if (perf_stats)
+    {
+        perf_open();
+        perf_phase("args");
+    }
+
     if (argc < 2)
     {
-        sys_write(STDOUT, "\n", 1);
-        return 0;
+        out_write(&out, "\n", 1);
+        return out_flush(&out) < 0;
     }
 
     int skip_new_line_char = 0;
+    int words = 0;
 
     // i = 1 to skip the program name string
     for (int i = 1; i < argc; i++)
     {
         if (argv[i][0] == '-')
         {
-            if ((_strcmp(argv[i], "-n")) == 0)
+            if ((strcmp(argv[i], "-n")) == 0)
             {
                 skip_new_line_char = 1;
                 continue;
             }
-        }
-
-        int written = 0;
-        int len = strlen(argv[i]);
-
-        while (written < len)
-        {
-            int n = sys_write(STDOUT, argv[i] + written, len - written);
-            if (n == 0) break;
-            if (n < 0)
+            if (i < opts)
             {
-                const char err[] = "sys_write failed with error";
-                sys_write(STDERR, err, sizeof(err)-1);
-                return(n);
+                continue;
             }
-
-            written += n;
         }
 
-
-        if (i != argc-1)
+        if (words++)
         {
-            sys_write(STDOUT, " ", 1);
+            out_write(&out, " ", 1);
         }
+        out_ref(&out, argv[i], strlen(argv[i]));
     }
 
     if (!skip_new_line_char)
     {
-        sys_write(STDOUT, "\n", 1);
+        out_write(&out, "\n", 1);
+    }
+
+    perf_phase("write");
+    long err = out_flush(&out);
+    if (err < 0)
+    {
+        const char err_msg[] = "sys_write failed with error";
+        sys_write(STDERR, err_msg, sizeof(err_msg)-1);
+        return(err);
     }
 
     return(0);
@@ -0,0 +1,128 @@
+#include <sys/mman.h>
+
+#include "sys.h"
+
+#define ARENA_PAGE      4096L
+#define ARENA_HUGE      (2L << 20)
+#define ARENA_DEFAULT   (1L << 20)
+
+static long align_up(long n, long to)
+{
+    return (n + to - 1) & ~(to - 1);
+}
+
+void arena_init(struct arena *a, long region_size, int flags)
+{
+    a->cur = 0;
+    a->region_size = region_size > 0 ? region_size : ARENA_DEFAULT;
+    a->flags = flags;
+}
+
+static struct arena_region *region_new(struct arena *a, long need)
+{
+    long size = need + align_up(sizeof(struct arena_region), 64);
+    if (size < a->region_size) size = a->region_size;
+    size = align_up(size, ARENA_PAGE);
+
+    struct arena_region *r = sys_mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (SYS_MMAP_FAILED(r))
+    {
+        return 0;
+    }
+    if ((a->flags & ARENA_HUGEPAGE) && size >= ARENA_HUGE)
+    {
+        sys_madvise(r, size, MADV_HUGEPAGE);
+    }
+
+    r->prev = a->cur;
+    r->size = size;
+    r->used = sizeof(struct arena_region);
+    a->cur = r;
+    return r;
+}
+
+// align must be a power of two
+void *arena_alloc_aligned(struct arena *a, long size, long align)
+{
+    if (size < 0 || align <= 0 || (align & (align - 1)))
+    {
+        return 0;
+    }
+
+    struct arena_region *r = a->cur;
+    if (r)
+    {
+        // alignment is of the address, not the offset
+        long base = (long)r;
+        long at = align_up(base + r->used, align) - base;
+        if (at + size <= r->size)
+        {
+            r->used = at + size;
+            return (char *)r + at;
+        }
+    }
+
+    // room for the worst-case padding as well
+    r = region_new(a, size + align);
+    if (!r)
+    {
+        return 0;
+    }
+    long base = (long)r;
+    long at = align_up(base + r->used, align) - base;
+    r->used = at + size;
+    return (char *)r + at;
+}
+
+void *arena_alloc(struct arena *a, long size)
+{
+    return arena_alloc_aligned(a, size, 16);
+}
+
+struct arena_mark arena_mark(struct arena *a)
+{
+    struct arena_mark m;
+    m.region = a->cur;
+    m.used = a->cur ? a->cur->used : 0;
+    return m;
+}
+
+// Everything allocated since the mark is gone afterwards, including any
+// regions that were chained on in the meantime.
+void arena_rollback(struct arena *a, struct arena_mark m)
+{
+    while (a->cur && a->cur != m.region)
+    {
+        struct arena_region *prev = a->cur->prev;
+        sys_munmap(a->cur, a->cur->size);
+        a->cur = prev;
+    }
+    if (a->cur)
+    {
+        a->cur->used = m.used;
+    }
+}
+
+void arena_reset(struct arena *a)
+{
+    while (a->cur && a->cur->prev)
+    {
+        struct arena_region *prev = a->cur->prev;
+        sys_munmap(a->cur, a->cur->size);
+        a->cur = prev;
+    }
+    if (a->cur)
+    {
+        a->cur->used = sizeof(struct arena_region);
+    }
+}
+
+void arena_free(struct arena *a)
+{
+    arena_reset(a);
+    if (a->cur)
+    {
+        sys_munmap(a->cur, a->cur->size);
+        a->cur = 0;
+    }
+}
@@ -0,0 +1,55 @@
+// auxv.c
+//
+// What the kernel leaves on the stack for _start:
+//
+//   rsp -> argc
+//          argv[0] .. argv[argc-1], 0
+//          envp[0] .. envp[n], 0
+//          auxv: (type, value) pairs ending with AT_NULL
+#include <elf.h>
+
+#include "sys.h"
+
+struct startup startup;
+
+void startup_parse(uintptr_t *rsp)
+{
+    startup.argc = (long)rsp[0];
+    startup.argv = (char **)(rsp + 1);
+    startup.envp = startup.argv + startup.argc + 1;
+
+    char **e = startup.envp;
+    while (*e) e++;
+    startup.auxv = (unsigned long *)(e + 1);
+}
+
+unsigned long auxv_get(unsigned long type)
+{
+    for (unsigned long *a = startup.auxv; a && a[0] != AT_NULL; a += 2)
+    {
+        if (a[0] == type) return a[1];
+    }
+    return 0;
+}
+
+int env_flag(const char *name)
+{
+    const char *v = env_get(name);
+    return v && *v && !(v[0] == '0' && !v[1]);
+}
+
+char *env_get(const char *name)
+{
+    for (char **e = startup.envp; e && *e; e++)
+    {
+        const char *n = name;
+        const char *v = *e;
+        while (*n && *n == *v)
+        {
+            n++;
+            v++;
+        }
+        if (!*n && *v == '=') return (char *)v + 1;
+    }
+    return 0;
+}
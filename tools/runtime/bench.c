@@ -0,0 +1,193 @@
+// bench.c
+//
+// Microbenchmark harness on the TSC.
+//
+// A sample is one batch of calls between `lfence; rdtsc` and
+// `rdtscp; lfence`, so the work can't leak out past either end. The batch
+// is sized in the warmup so a sample takes at least BENCH_SAMPLE_NS, and
+// the cost of an empty timed region is taken off every sample.
+//
+// Noise only ever makes a sample slower, so outliers are rejected on the
+// high side only: anything more than OUTLIER_MADS median absolute
+// deviations above the median.
+//
+// Ticks become time through a TSC rate measured against CLOCK_MONOTONIC
+// at bench_init. That assumes an invariant TSC, which every x86-64 CPU
+// of the last decade has.
+#include "sys.h"
+
+#define BENCH_WARMUP_NS   (20 * 1000 * 1000L)
+#define BENCH_SAMPLE_NS   (50 * 1000L)
+#define BENCH_BUDGET_NS   (300 * 1000 * 1000L)    // per benchmark, after warmup
+#define BENCH_MIN_SAMPLES 11
+#define OUTLIER_MADS      5
+
+static double tsc_per_ns;
+static unsigned long overhead;     // ticks of an empty timed region
+
+static char out_buf[4096];
+static struct out out;
+
+static inline unsigned long tsc_begin(void)
+{
+    unsigned lo, hi;
+    asm volatile ("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static inline unsigned long tsc_end(void)
+{
+    unsigned lo, hi;
+    asm volatile ("rdtscp\n\tlfence" : "=a"(lo), "=d"(hi) :: "rcx", "memory");
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime_fast(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void sort(double *v, int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        double x = v[i];
+        int j = i;
+        for (; j > 0 && v[j - 1] > x; j--) v[j] = v[j - 1];
+        v[j] = x;
+    }
+}
+
+static double fabs_(double x)
+{
+    return x < 0 ? -x : x;
+}
+
+// one decimal, right-aligned
+static void put_fixed(double v, int width)
+{
+    long tenths = (long)(v * 10 + 0.5);
+    out_dec(&out, tenths / 10, width - 2);
+    out_write(&out, ".", 1);
+    out_dec(&out, tenths % 10, 0);
+}
+
+static void put_left(const char *s, int width)
+{
+    int n = strlen(s);
+    out_str(&out, s);
+    while (n++ < width) out_write(&out, " ", 1);
+}
+
+void bench_init(void)
+{
+    out_init(&out, STDOUT, out_buf, sizeof(out_buf));
+
+    // 50 ms of spinning is enough for a rate good to well under 0.1%
+    long n0 = now_ns();
+    unsigned long t0 = tsc_begin();
+    long n1;
+    while ((n1 = now_ns()) - n0 < 50 * 1000 * 1000L)
+        ;
+    unsigned long t1 = tsc_end();
+    tsc_per_ns = (double)(t1 - t0) / (n1 - n0);
+
+    overhead = ~0UL;
+    for (int i = 0; i < 1000; i++)
+    {
+        unsigned long a = tsc_begin();
+        unsigned long b = tsc_end();
+        if (b - a < overhead) overhead = b - a;
+    }
+
+    out_str(&out, "tsc ");
+    put_fixed(tsc_per_ns * 1000, 0);
+    out_str(&out, " MHz, timer overhead ");
+    out_dec(&out, overhead, 0);
+    out_str(&out, " ticks\n");
+    out_flush(&out);
+}
+
+void bench_suite(const char *name)
+{
+    out_str(&out, "\n");
+    put_left(name, 32);
+    out_str(&out, "      min ns   median ns      p99 ns       MiB/s  rejected\n");
+    out_flush(&out);
+}
+
+void bench_run(struct bench_result *r, const char *name, bench_fn *fn, void *arg, long bytes)
+{
+    static double samples[BENCH_SAMPLES];
+    struct bench_result res = {0};
+
+    // warm up caches, branch predictors and clocks, and size the batch
+    long calls = 0;
+    unsigned long warm_ticks = BENCH_WARMUP_NS * tsc_per_ns;
+    unsigned long start = tsc_begin();
+    unsigned long elapsed;
+    do
+    {
+        fn(arg, 1);
+        calls++;
+        elapsed = tsc_end() - start;
+    } while (elapsed < warm_ticks);
+
+    double per_call = (double)elapsed / calls;
+    long batch = BENCH_SAMPLE_NS * tsc_per_ns / per_call;
+    if (batch < 1) batch = 1;
+
+    unsigned long budget = BENCH_BUDGET_NS * tsc_per_ns;
+    unsigned long spent = 0;
+    int n = 0;
+    while (n < BENCH_SAMPLES && (spent < budget || n < BENCH_MIN_SAMPLES))
+    {
+        unsigned long a = tsc_begin();
+        fn(arg, batch);
+        unsigned long b = tsc_end();
+
+        unsigned long ticks = b - a;
+        spent += ticks;
+        ticks = ticks > overhead ? ticks - overhead : 0;
+        samples[n++] = (double)ticks / batch / tsc_per_ns;
+    }
+
+    sort(samples, n);
+    double median = samples[n / 2];
+
+    static double dev[BENCH_SAMPLES];
+    for (int i = 0; i < n; i++) dev[i] = fabs_(samples[i] - median);
+    sort(dev, n);
+    double limit = median + OUTLIER_MADS * 1.4826 * dev[n / 2];
+
+    int kept = n;
+    while (kept > BENCH_MIN_SAMPLES && samples[kept - 1] > limit) kept--;
+
+    res.samples = kept;
+    res.rejected = n - kept;
+    res.min_ns = samples[0];
+    res.median_ns = samples[kept / 2];
+    res.p99_ns = samples[(kept * 99 + 99) / 100 - 1];
+    if (bytes && res.median_ns > 0)
+    {
+        res.bytes_per_sec = bytes / res.median_ns * 1e9;
+    }
+
+    out_str(&out, "  ");
+    put_left(name, 30);
+    put_fixed(res.min_ns, 12);
+    put_fixed(res.median_ns, 12);
+    put_fixed(res.p99_ns, 12);
+    if (bytes) put_fixed(res.bytes_per_sec / (1 << 20), 12);
+    else       out_str(&out, "           -");
+    out_dec(&out, res.rejected, 10);
+    out_write(&out, "\n", 1);
+    out_flush(&out);
+
+    if (r)
+    {
+        *r = res;
+    }
+}
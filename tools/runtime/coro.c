@@ -0,0 +1,263 @@
+// coro.c
+//
+// Each coroutine gets one mapping, like a thread does:
+//
+//   [guard page][stack ............][struct coro]
+//
+// Switching is coro_switch below: push the callee-saved registers, swap
+// rsp, pop the other side's and return into it. Everything else is
+// already saved by the compiler around the call. The SSE and x87 control
+// words are callee-saved too but nothing in the runtime changes them, so
+// they aren't switched.
+//
+// A new stack is laid out as if it had been switched out right before
+// coro_entry: six zeroed registers, then coro_entry as the return
+// address, then a zero return address for coro_entry itself so the frame
+// chain ends there and rsp is aligned the way a called function wants.
+//
+// Waits use EPOLLONESHOT with the coroutine as the data pointer: an fd
+// stays registered after its first wait and is re-armed with one
+// EPOLL_CTL_MOD per wait after that. The kernel drops it from the epoll
+// set when it's closed.
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "sys.h"
+
+#define PAGE 4096L
+
+static __thread struct sched *self_sched;
+
+// save the callee-saved registers and rsp into *save, resume `to`; the
+// arguments are only used from the asm, in rdi and rsi
+__attribute__((naked, noinline))
+static void coro_switch(__attribute__((unused)) void **save, __attribute__((unused)) void *to)
+{
+    asm volatile (
+        "push %%rbp\n\t"
+        "push %%rbx\n\t"
+        "push %%r12\n\t"
+        "push %%r13\n\t"
+        "push %%r14\n\t"
+        "push %%r15\n\t"
+        "mov %%rsp, (%%rdi)\n\t"
+        "mov %%rsi, %%rsp\n\t"
+        "pop %%r15\n\t"
+        "pop %%r14\n\t"
+        "pop %%r13\n\t"
+        "pop %%r12\n\t"
+        "pop %%rbx\n\t"
+        "pop %%rbp\n\t"
+        "ret"
+        :
+        :
+        : "memory"
+    );
+}
+
+// a coroutine's first C code, on its own stack
+__attribute__((noreturn))
+static void coro_entry(void)
+{
+    struct sched *s = self_sched;
+    struct coro *c = s->current;
+    c->fn(c->arg);
+    c->done = 1;
+    coro_switch(&c->sp, s->sp);
+    __builtin_unreachable();
+}
+
+static void push_runnable(struct sched *s, struct coro *c)
+{
+    c->next = 0;
+    if (s->tail) s->tail->next = c;
+    else         s->head = c;
+    s->tail = c;
+}
+
+static struct coro *pop_runnable(struct sched *s)
+{
+    struct coro *c = s->head;
+    if (c)
+    {
+        s->head = c->next;
+        if (!s->head) s->tail = 0;
+    }
+    return c;
+}
+
+long sched_init(struct sched *s)
+{
+    long fd = sys_epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    s->sp = 0;
+    s->current = 0;
+    s->head = 0;
+    s->tail = 0;
+    s->epfd = fd;
+    s->live = 0;
+    return 0;
+}
+
+void sched_free(struct sched *s)
+{
+    sys_close(s->epfd);
+    s->epfd = -1;
+}
+
+long coro_spawn(struct sched *s, coro_fn *fn, void *arg, long stack_size)
+{
+    if (stack_size <= 0) stack_size = CORO_STACK;
+    stack_size = (stack_size + PAGE - 1) & ~(PAGE - 1);
+
+    long size = PAGE + stack_size + ((sizeof(struct coro) + PAGE - 1) & ~(PAGE - 1));
+    char *map = sys_mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (SYS_MMAP_FAILED(map))
+    {
+        return (long)map;
+    }
+    // overflowing the stack faults instead of walking into other memory
+    sys_mprotect(map, PAGE, PROT_NONE);
+
+    struct coro *c = (struct coro *)(map + size) - 1;
+    c->sched = s;
+    c->fn = fn;
+    c->arg = arg;
+    c->events = 0;
+    c->done = 0;
+    c->map = map;
+    c->map_size = size;
+
+    unsigned long *sp = (unsigned long *)((unsigned long)c & ~15UL);
+    *--sp = 0;                              // coro_entry's return address
+    *--sp = (unsigned long)coro_entry;
+    for (int i = 0; i < 6; i++) *--sp = 0;  // rbp, rbx, r12-r15
+    c->sp = sp;
+
+    s->live++;
+    push_runnable(s, c);
+    return 0;
+}
+
+long sched_run(struct sched *s)
+{
+    struct sched *outer = self_sched;
+    struct epoll_event events[CORO_EVENTS];
+    long err = 0;
+
+    self_sched = s;
+    while (s->live > 0)
+    {
+        struct coro *c;
+        while ((c = pop_runnable(s)))
+        {
+            s->current = c;
+            coro_switch(&s->sp, c->sp);
+            s->current = 0;
+            if (c->done)
+            {
+                s->live--;
+                sys_munmap(c->map, c->map_size);
+            }
+        }
+        if (s->live == 0)
+        {
+            break;
+        }
+
+        long n = sys_epoll_wait(s->epfd, events, CORO_EVENTS, -1);
+        if (n == -EINTR) continue;
+        if (n < 0)
+        {
+            err = n;
+            break;
+        }
+        for (long i = 0; i < n; i++)
+        {
+            c = events[i].data.ptr;
+            c->events = events[i].events;
+            push_runnable(s, c);
+        }
+    }
+    self_sched = outer;
+    return err;
+}
+
+struct coro *coro_self(void)
+{
+    struct sched *s = self_sched;
+    return s ? s->current : 0;
+}
+
+void coro_yield(void)
+{
+    struct coro *c = coro_self();
+    if (!c)
+    {
+        return;
+    }
+    push_runnable(c->sched, c);
+    coro_switch(&c->sp, c->sched->sp);
+}
+
+long coro_wait(int fd, unsigned events)
+{
+    struct coro *c = coro_self();
+    if (!c)
+    {
+        return -EPERM;
+    }
+    struct sched *s = c->sched;
+
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = c;
+    long err = sys_epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev);
+    if (err == -ENOENT)
+    {
+        err = sys_epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (err < 0)
+    {
+        return err;
+    }
+
+    coro_switch(&c->sp, s->sp);
+    return c->events;
+}
+
+long coro_read(int fd, void *buf, long n)
+{
+    for (;;)
+    {
+        long r = sys_read(fd, buf, n);
+        if (r == -EINTR) continue;
+        if (r != -EAGAIN) return r;
+
+        long err = coro_wait(fd, EPOLLIN);
+        if (err < 0) return err;
+    }
+}
+
+long coro_write(int fd, const void *buf, long n)
+{
+    const char *p = buf;
+    long done = 0;
+    while (done < n)
+    {
+        long w = sys_write(fd, p + done, n - done);
+        if (w == -EINTR) continue;
+        if (w == -EAGAIN)
+        {
+            w = coro_wait(fd, EPOLLOUT);
+            if (w < 0) return w;
+            continue;
+        }
+        if (w < 0) return w;
+        done += w;
+    }
+    return done;
+}
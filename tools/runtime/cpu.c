@@ -0,0 +1,85 @@
+// cpu.c
+//
+// Static -nostdlib binaries get no ifunc resolution from glibc, so we do
+// our own: probe the CPU once at startup and fill in a table of function
+// pointers that the hot kernels are called through.
+#include "sys.h"
+
+struct cpu_features cpu;
+
+// SSE2 is part of x86-64, so these are safe before cpu_init has run
+struct kernels kernels =
+{
+    strlen_sse2,
+    strcmp_sse2,
+    memchr_sse2,
+    memcpy_sse2,
+    memset_sse2,
+};
+
+static void cpuid(unsigned leaf, unsigned sub, unsigned r[4])
+{
+    asm volatile ("cpuid"
+                  : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3])
+                  : "a"(leaf), "c"(sub));
+}
+
+// which register states the OS saves on a context switch
+static unsigned long xgetbv(unsigned index)
+{
+    unsigned lo, hi;
+    asm volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+#define XCR0_SSE      (1UL << 1)
+#define XCR0_AVX      (1UL << 2)
+#define XCR0_OPMASK   (1UL << 5)
+#define XCR0_ZMM_HI   (3UL << 6)
+
+void cpu_init(void)
+{
+    unsigned r[4];
+
+    cpuid(0, 0, r);
+    unsigned max_leaf = r[0];
+
+    cpuid(1, 0, r);
+    cpu.sse2   = (r[3] >> 26) & 1;
+    cpu.sse42  = (r[2] >> 20) & 1;
+    cpu.popcnt = (r[2] >> 23) & 1;
+    int osxsave = (r[2] >> 27) & 1;
+    int avx     = (r[2] >> 28) & 1;
+
+    // CPUID says what the core can do, XCR0 says what the OS will
+    // preserve for us; using YMM/ZMM registers needs both
+    unsigned long xcr0 = osxsave ? xgetbv(0) : 0;
+    int os_avx    = (xcr0 & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX);
+    int os_avx512 = os_avx && (xcr0 & (XCR0_OPMASK | XCR0_ZMM_HI)) == (XCR0_OPMASK | XCR0_ZMM_HI);
+
+    cpu.avx = avx && os_avx;
+    if (max_leaf >= 7)
+    {
+        cpuid(7, 0, r);
+        cpu.avx2     = cpu.avx && ((r[1] >> 5) & 1);
+        cpu.bmi2     = (r[1] >> 8) & 1;
+        cpu.avx512f  = os_avx512 && ((r[1] >> 16) & 1);
+        cpu.avx512bw = cpu.avx512f && ((r[1] >> 30) & 1);
+    }
+
+    if (cpu.avx2)
+    {
+        kernels.strlen = strlen_avx2;
+        kernels.strcmp = strcmp_avx2;
+        kernels.memchr = memchr_avx2;
+        kernels.memcpy = memcpy_avx2;
+        kernels.memset = memset_avx2;
+    }
+    if (cpu.avx512bw)
+    {
+        kernels.strlen = strlen_avx512;
+        kernels.memchr = memchr_avx512;
+        kernels.memcpy = memcpy_avx512;
+        kernels.memset = memset_avx512;
+    }
+}
@@ -0,0 +1,249 @@
+// loop.c
+//
+// One epoll fd, every watch registered edge-triggered with the watch
+// itself as the event's data pointer. A batch of up to LOOP_EVENTS comes
+// back from each epoll_wait and is dispatched in order; loop_del clears a
+// watch out of whatever is left of the batch, so a callback may remove
+// (and free) any watch, including its own.
+#include <errno.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "sys.h"
+
+#define SIG_BLOCK 0
+
+long loop_init(struct loop *l)
+{
+    long fd = sys_epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    l->epfd = fd;
+    l->stop = 0;
+    l->nwatches = 0;
+    l->pending = 0;
+    l->batch = 0;
+    return 0;
+}
+
+void loop_free(struct loop *l)
+{
+    sys_close(l->epfd);
+    l->epfd = -1;
+}
+
+static long watch(struct loop *l, struct loop_watch *w, int fd, int kind, unsigned events, loop_fn *fn, void *data)
+{
+    w->fd = fd;
+    w->kind = kind;
+    w->fn = fn;
+    w->data = data;
+    w->expirations = 0;
+    w->sig = 0;
+    w->pid = 0;
+
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = w;
+    long err = sys_epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (err < 0)
+    {
+        return err;
+    }
+    l->nwatches++;
+    return 0;
+}
+
+long loop_add(struct loop *l, struct loop_watch *w, int fd, unsigned events, loop_fn *fn, void *data)
+{
+    return watch(l, w, fd, LOOP_FD, events, fn, data);
+}
+
+long loop_mod(struct loop *l, struct loop_watch *w, unsigned events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = w;
+    return sys_epoll_ctl(l->epfd, EPOLL_CTL_MOD, w->fd, &ev);
+}
+
+// Timer and signal watches own their fd and close it here.
+long loop_del(struct loop *l, struct loop_watch *w)
+{
+    long err = sys_epoll_ctl(l->epfd, EPOLL_CTL_DEL, w->fd, 0);
+    if (err == 0)
+    {
+        l->nwatches--;
+    }
+
+    for (int i = 0; i < l->pending; i++)
+    {
+        if (l->batch[i].data.ptr == w) l->batch[i].data.ptr = 0;
+    }
+
+    if (w->kind != LOOP_FD)
+    {
+        sys_close(w->fd);
+    }
+    w->fd = -1;
+    return err;
+}
+
+long loop_timer_set(struct loop_watch *w, long first_ns, long interval_ns)
+{
+    struct itimerspec its;
+    its.it_value.tv_sec = first_ns / 1000000000L;
+    its.it_value.tv_nsec = first_ns % 1000000000L;
+    its.it_interval.tv_sec = interval_ns / 1000000000L;
+    its.it_interval.tv_nsec = interval_ns % 1000000000L;
+    return sys_timerfd_settime(w->fd, 0, &its, 0);
+}
+
+// first_ns from now, then every interval_ns (0 for a one-shot)
+long loop_timer(struct loop *l, struct loop_watch *w, long first_ns, long interval_ns, loop_fn *fn, void *data)
+{
+    long fd = sys_timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        return fd;
+    }
+
+    long err = watch(l, w, fd, LOOP_TIMER, EPOLLIN, fn, data);
+    if (err == 0)
+    {
+        // a zero first expiry would disarm it, fire as soon as possible instead
+        err = loop_timer_set(w, first_ns > 0 ? first_ns : 1, interval_ns);
+    }
+    if (err < 0)
+    {
+        loop_del(l, w);
+    }
+    return err;
+}
+
+// The signals in sigmask (bit signo - 1) are blocked in the calling
+// thread so they queue up for the signalfd instead of being delivered.
+// Other threads should block them too, or the kernel may pick one of
+// those to deliver to.
+long loop_signal(struct loop *l, struct loop_watch *w, unsigned long sigmask, loop_fn *fn, void *data)
+{
+    long err = sys_rt_sigprocmask(SIG_BLOCK, &sigmask, 0);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    long fd = sys_signalfd4(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        return fd;
+    }
+
+    err = watch(l, w, fd, LOOP_SIGNAL, EPOLLIN, fn, data);
+    if (err < 0)
+    {
+        sys_close(fd);
+    }
+    return err;
+}
+
+// i is w's slot in the batch; loop_del clears that slot, which is how a
+// removal by the callback shows up without touching w again
+static void dispatch(struct loop *l, long i, struct loop_watch *w, unsigned events)
+{
+    if (w->kind == LOOP_FD)
+    {
+        w->fn(l, w, events);
+        return;
+    }
+
+    // edge-triggered: drain the fd, one callback per timer read or signal
+    for (;;)
+    {
+        if (w->kind == LOOP_TIMER)
+        {
+            unsigned long n;
+            if (sys_read(w->fd, &n, sizeof(n)) != sizeof(n)) return;
+            w->expirations = n;
+        }
+        else
+        {
+            struct signalfd_siginfo si;
+            if (sys_read(w->fd, &si, sizeof(si)) != sizeof(si)) return;
+            w->sig = si.ssi_signo;
+            w->pid = si.ssi_pid;
+        }
+
+        w->fn(l, w, events);
+        if (l->batch[i].data.ptr != w) return;    // the callback removed it
+    }
+}
+
+long loop_run(struct loop *l)
+{
+    struct epoll_event events[LOOP_EVENTS];
+
+    l->stop = 0;
+    while (!l->stop && l->nwatches > 0)
+    {
+        long n = sys_epoll_wait(l->epfd, events, LOOP_EVENTS, -1);
+        if (n == -EINTR) continue;
+        if (n < 0) return n;
+
+        l->batch = events;
+        l->pending = n;
+        for (long i = 0; i < n && !l->stop; i++)
+        {
+            struct loop_watch *w = events[i].data.ptr;
+            if (w) dispatch(l, i, w, events[i].events);
+        }
+        l->pending = 0;
+        l->batch = 0;
+    }
+    return 0;
+}
+
+void loop_stop(struct loop *l)
+{
+    l->stop = 1;
+}
+
+// fd helpers
+
+long fd_nonblock(int fd)
+{
+    long flags = sys_fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+    {
+        return flags;
+    }
+    if (flags & O_NONBLOCK)
+    {
+        return 0;
+    }
+    return sys_fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+long nb_read(int fd, void *buf, long n)
+{
+    long r;
+    while ((r = sys_read(fd, buf, n)) == -EINTR)
+        ;
+    return r;
+}
+
+long nb_write(int fd, const void *buf, long n)
+{
+    const char *p = buf;
+    long done = 0;
+    while (done < n)
+    {
+        long w = sys_write(fd, p + done, n - done);
+        if (w == -EINTR) continue;
+        if (w < 0) return done ? done : w;
+        done += w;
+    }
+    return done;
+}
@@ -0,0 +1,171 @@
+#include <errno.h>
+
+#include "sys.h"
+
+static struct out *streams;
+
+void out_init(struct out *o, int fd, char *buf, long cap)
+{
+    o->fd   = fd;
+    o->err  = 0;
+    o->buf  = buf;
+    o->cap  = cap;
+    o->len  = 0;
+    o->niov = 0;
+
+    o->next = streams;
+    streams = o;
+}
+
+long out_flush(struct out *o)
+{
+    struct iovec *iov = o->iov;
+    int n = o->niov;
+
+    while (n > 0 && !o->err)
+    {
+        long w = sys_writev(o->fd, iov, n);
+        if (w == -EINTR) continue;
+        if (w < 0)
+        {
+            o->err = w;
+            break;
+        }
+        long wrote = w;
+
+        // drop whatever went out, a short write leaves us mid-iovec
+        while (n > 0 && w >= (long)iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            // nothing went out but bytes are left, don't spin on it
+            if (wrote == 0)
+            {
+                o->err = -EIO;
+                break;
+            }
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+
+    o->niov = 0;
+    o->len  = 0;
+    return o->err;
+}
+
+static long queue(struct out *o, const void *p, long n)
+{
+    if (o->niov == OUT_IOV && out_flush(o) < 0)
+    {
+        return o->err;
+    }
+    o->iov[o->niov].iov_base = (void *)p;
+    o->iov[o->niov].iov_len  = n;
+    o->niov++;
+    return 0;
+}
+
+long out_write(struct out *o, const void *p, long n)
+{
+    if (o->err)
+    {
+        return o->err;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    if (n > o->cap - o->len)
+    {
+        // too big to be worth copying: send it with whatever is queued
+        if (n >= o->cap / 2)
+        {
+            if (queue(o, p, n) < 0) return o->err;
+            return out_flush(o);
+        }
+        if (out_flush(o) < 0) return o->err;
+    }
+    // make room for the iovec up front, a flush after copying would
+    // reuse the buffer under it
+    if (o->niov == OUT_IOV && out_flush(o) < 0)
+    {
+        return o->err;
+    }
+
+    char *dst = o->buf + o->len;
+    const char *src = p;
+    for (long i = 0; i < n; i++) dst[i] = src[i];
+
+    // grow the last iovec if it already ends where we just copied to
+    struct iovec *last = o->niov ? &o->iov[o->niov - 1] : 0;
+    if (last && (char *)last->iov_base + last->iov_len == dst)
+    {
+        last->iov_len += n;
+    }
+    else if (queue(o, dst, n) < 0)
+    {
+        return o->err;
+    }
+
+    o->len += n;
+    return 0;
+}
+
+long out_ref(struct out *o, const void *p, long n)
+{
+    if (o->err)
+    {
+        return o->err;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (n < OUT_COPY_MAX)
+    {
+        return out_write(o, p, n);
+    }
+    return queue(o, p, n);
+}
+
+long out_str(struct out *o, const char *s)
+{
+    return out_write(o, s, strlen(s));
+}
+
+// right-aligned in `width` columns, no padding when width is 0
+long out_dec(struct out *o, long v, int width)
+{
+    char tmp[24];
+    int n = 0;
+    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+    do
+    {
+        tmp[sizeof(tmp) - ++n] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0) tmp[sizeof(tmp) - ++n] = '-';
+
+    while (width-- > n)
+    {
+        if (out_write(o, " ", 1) < 0) return o->err;
+    }
+    return out_write(o, tmp + sizeof(tmp) - n, n);
+}
+
+long out_flush_all(void)
+{
+    long err = 0;
+    for (struct out *o = streams; o; o = o->next)
+    {
+        if (out_flush(o) < 0) err = o->err;
+    }
+    return err;
+}
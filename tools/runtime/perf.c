@@ -0,0 +1,253 @@
+// perf.c
+//
+// Hardware counters for the calling thread through perf_event_open, so a
+// tool can report its own cycles and misses where `perf` isn't installed.
+//
+// The counters are opened as one group so they're scheduled onto the PMU
+// together. Each fd's first page is mapped: when the kernel allows it
+// (cap_user_rdpmc) a counter is read with rdpmc from user space, under
+// the page's seqlock, otherwise with read(2). Counters the kernel or the
+// machine won't give us (VMs often have no PMU) are left out and shown
+// as "-".
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+
+#include "sys.h"
+
+static const struct
+{
+    const char *name;
+    unsigned type;
+    unsigned long config;
+} events[PERF_COUNTERS] =
+{
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "ctx-switches",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static struct
+{
+    int fd[PERF_COUNTERS];                            // -1 when not open
+    struct perf_event_mmap_page *page[PERF_COUNTERS];
+    int open;
+    int started;                                      // perf_open has run
+    long status;                                      // and returned this
+
+    const char *phase[PERF_MAX_PHASES];
+    struct perf_sample total[PERF_MAX_PHASES];
+    int nphases;
+    int cur;                                          // -1 outside any phase
+    struct perf_sample start;
+} perf;
+
+static char err_buf[1024];
+static struct out err_out;
+
+static long perf_event_open(struct perf_event_attr *attr, int pid, int cpu, int group, unsigned long flags)
+{
+    return syscall5(SYS_perf_event_open, (long)attr, pid, cpu, group, flags);
+}
+
+static unsigned long rdpmc(unsigned counter)
+{
+    unsigned lo, hi;
+    asm volatile ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+// -1 when the page says rdpmc isn't usable for this counter right now
+static long read_user(struct perf_event_mmap_page *pc)
+{
+    unsigned seq;
+    long count;
+
+    do
+    {
+        seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+        unsigned idx = pc->index;
+        if (!pc->cap_user_rdpmc || idx == 0)
+        {
+            return -1;
+        }
+
+        // the hardware counter is pmc_width bits, sign-extend it
+        long pmc = rdpmc(idx - 1);
+        int shift = 64 - pc->pmc_width;
+        pmc = (pmc << shift) >> shift;
+        count = pc->offset + pmc;
+
+        asm volatile ("" ::: "memory");
+    } while (__atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE) != seq);
+
+    return count;
+}
+
+static long read_counter(int i)
+{
+    if (perf.fd[i] < 0)
+    {
+        return -1;
+    }
+    if (perf.page[i])
+    {
+        long v = read_user(perf.page[i]);
+        if (v >= 0) return v;
+    }
+
+    unsigned long v;
+    if (sys_read(perf.fd[i], &v, sizeof(v)) != sizeof(v))
+    {
+        return -1;
+    }
+    return v;
+}
+
+void perf_read(struct perf_sample *s)
+{
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        s->v[i] = read_counter(i);
+    }
+}
+
+static void phase_end(void)
+{
+    if (perf.cur < 0)
+    {
+        return;
+    }
+
+    struct perf_sample now;
+    perf_read(&now);
+    struct perf_sample *t = &perf.total[perf.cur];
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        if (now.v[i] >= 0 && perf.start.v[i] >= 0) t->v[i] += now.v[i] - perf.start.v[i];
+        else t->v[i] = -1;
+    }
+    perf.cur = -1;
+}
+
+// A name used again adds to the same line, so per-file phases sum up.
+void perf_phase(const char *name)
+{
+    if (!err_out.buf)
+    {
+        return;
+    }
+    phase_end();
+
+    int p = 0;
+    while (p < perf.nphases && strcmp(perf.phase[p], name) != 0) p++;
+    if (p == perf.nphases)
+    {
+        if (p == PERF_MAX_PHASES) return;
+        perf.phase[p] = name;
+        perf.nphases++;
+    }
+
+    perf.cur = p;
+    perf_read(&perf.start);
+}
+
+static void left(struct out *o, const char *s, int width)
+{
+    int n = strlen(s);
+    out_str(o, s);
+    while (n++ < width) out_write(o, " ", 1);
+}
+
+static void right(struct out *o, const char *s, int width)
+{
+    int n = strlen(s);
+    while (n++ < width) out_write(o, " ", 1);
+    out_str(o, s);
+}
+
+// runs from rt_exit
+static void perf_report(void)
+{
+    phase_end();
+
+    struct out *o = &err_out;
+    left(o, "perf: phase", 18);
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        right(o, events[i].name, 16);
+    }
+    out_write(o, "\n", 1);
+
+    for (int p = 0; p < perf.nphases; p++)
+    {
+        out_str(o, "perf: ");
+        left(o, perf.phase[p], 12);
+        for (int i = 0; i < PERF_COUNTERS; i++)
+        {
+            if (perf.total[p].v[i] >= 0) out_dec(o, perf.total[p].v[i], 16);
+            else right(o, "-", 16);
+        }
+        out_write(o, "\n", 1);
+    }
+    out_flush(o);
+}
+
+// The report goes to stderr from rt_exit. Returns how many counters
+// opened, or the error from the first one when none did. Calling it
+// again just returns that again.
+long perf_open(void)
+{
+    if (perf.started)
+    {
+        return perf.status;
+    }
+    perf.started = 1;
+
+    long first_err = 0;
+    int leader = -1;
+
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        struct perf_event_attr attr = {0};
+        attr.type = events[i].type;
+        attr.size = sizeof(attr);
+        attr.config = events[i].config;
+        attr.exclude_kernel = 1;      // all that perf_event_paranoid=2 allows
+        attr.exclude_hv = 1;
+
+        long fd = perf_event_open(&attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0 && leader >= 0)
+        {
+            // some PMUs won't take it in the group, count it on its own
+            fd = perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        perf.fd[i] = fd;
+        perf.page[i] = 0;
+        if (fd < 0)
+        {
+            if (!first_err) first_err = fd;
+            continue;
+        }
+        if (leader < 0)
+        {
+            leader = fd;
+        }
+        perf.open++;
+
+        if (events[i].type == PERF_TYPE_HARDWARE)
+        {
+            void *pg = sys_mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 0);
+            if (!SYS_MMAP_FAILED(pg)) perf.page[i] = pg;
+        }
+    }
+
+    // report even with nothing open, a table of "-" says why
+    perf.cur = -1;
+    out_init(&err_out, STDERR, err_buf, sizeof(err_buf));
+    rt_atexit(perf_report);
+    perf.status = perf.open ? perf.open : first_err;
+    return perf.status;
+}
@@ -0,0 +1,390 @@
+// pool.c
+//
+// Work-stealing scheduler on top of thread.c.
+//
+// Every worker owns a Chase-Lev deque: the owner pushes and pops at the
+// bottom without any locked instruction except when it takes the last
+// task, thieves take from the top with a CAS. The deque is a fixed ring;
+// when it is full a range just stops splitting and runs as it is.
+//
+// A task is only (group, lo, hi), three words, so a thief can read a slot
+// with plain atomic loads before its CAS decides whether it got it.
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "sys.h"
+
+#define POOL_CPU_WORDS 16     // affinity mask words, 1024 CPUs
+#define STEAL_ROUNDS   4      // passes over the victims before sleeping
+
+struct task
+{
+    struct task_group *g;
+    long lo;
+    long hi;
+};
+
+// top and bottom on lines of their own, thieves hammer top
+struct pool_worker
+{
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    struct task tasks[POOL_DEQUE];
+    struct pool *pool;
+    struct thread *thread;
+    int   index;
+    int   cpu;
+    unsigned long rng;
+} __attribute__((aligned(64)));
+
+static __thread struct pool_worker *self_worker;
+
+// deque
+
+static void slot_store(struct pool_worker *w, long i, struct task t)
+{
+    struct task *s = &w->tasks[i & (POOL_DEQUE - 1)];
+    __atomic_store_n(&s->g, t.g, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->lo, t.lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->hi, t.hi, __ATOMIC_RELAXED);
+}
+
+static void slot_load(struct pool_worker *w, long i, struct task *t)
+{
+    struct task *s = &w->tasks[i & (POOL_DEQUE - 1)];
+    t->g  = __atomic_load_n(&s->g, __ATOMIC_RELAXED);
+    t->lo = __atomic_load_n(&s->lo, __ATOMIC_RELAXED);
+    t->hi = __atomic_load_n(&s->hi, __ATOMIC_RELAXED);
+}
+
+static int deque_push(struct pool_worker *w, struct task t)
+{
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    if (b - top >= POOL_DEQUE)
+    {
+        return 0;
+    }
+    slot_store(w, b, t);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int deque_pop(struct pool_worker *w, struct task *t)
+{
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+    if (top > b)
+    {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    slot_load(w, b, t);
+    if (top < b)
+    {
+        return 1;
+    }
+
+    // the last task, thieves may be after it too
+    int won = __atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    return won;
+}
+
+static int deque_steal(struct pool_worker *w, struct task *t)
+{
+    long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b)
+    {
+        return 0;
+    }
+    slot_load(w, top, t);
+    return __atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static int deque_empty(struct pool_worker *w)
+{
+    return __atomic_load_n(&w->top, __ATOMIC_SEQ_CST) >= __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+}
+
+// scheduling
+
+static unsigned long next_rand(struct pool_worker *w)
+{
+    unsigned long x = w->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return w->rng = x;
+}
+
+static int find_work(struct pool_worker *w, struct task *t)
+{
+    if (deque_pop(w, t))
+    {
+        return 1;
+    }
+
+    struct pool *p = w->pool;
+    if (p->n < 2)
+    {
+        return 0;
+    }
+    for (int i = 0; i < STEAL_ROUNDS * p->n; i++)
+    {
+        int victim = next_rand(w) % p->n;
+        if (victim != w->index && deque_steal(&p->workers[victim], t))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int any_work(struct pool *p)
+{
+    for (int i = 0; i < p->n; i++)
+    {
+        if (!deque_empty(&p->workers[i])) return 1;
+    }
+    return 0;
+}
+
+// The sleeper bumps `sleepers` before its last look at the deques and a
+// pusher checks `sleepers` after publishing, both seq_cst, so one of the
+// two always sees the other.
+static void wake_one(struct pool *p)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleepers, __ATOMIC_RELAXED))
+    {
+        __atomic_fetch_add(&p->seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&p->seq, 1);
+    }
+}
+
+static void park(struct pool *p)
+{
+    int seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (!any_work(p) && !__atomic_load_n(&p->stop, __ATOMIC_SEQ_CST))
+    {
+        futex_wait(&p->seq, seq);
+    }
+    __atomic_fetch_sub(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static int spawn(struct pool_worker *w, struct task_group *g, long lo, long hi)
+{
+    struct task t = { g, lo, hi };
+    __atomic_fetch_add(&g->pending, 1, __ATOMIC_ACQ_REL);
+    if (!deque_push(w, t))
+    {
+        __atomic_fetch_sub(&g->pending, 1, __ATOMIC_ACQ_REL);
+        return 0;
+    }
+    wake_one(w->pool);
+    return 1;
+}
+
+static void run_task(struct pool_worker *w, struct task t)
+{
+    struct task_group *g = t.g;
+
+    // hand the upper halves out until what's left is one grain
+    while (t.hi - t.lo > g->grain)
+    {
+        long mid = t.lo + (t.hi - t.lo) / 2;
+        if (!spawn(w, g, mid, t.hi))
+        {
+            break;
+        }
+        t.hi = mid;
+    }
+    g->fn(g->arg, t.lo, t.hi);
+
+    // the group usually lives on its waiter's stack and may be gone once
+    // pending reads zero, so the wake goes through the pool's word instead
+    struct pool *p = g->pool;
+    if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        __atomic_fetch_add(&p->done, 1, __ATOMIC_RELEASE);
+        futex_wake(&p->done, 0x7fffffff);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct pool_worker *w = arg;
+    struct pool *p = w->pool;
+    self_worker = w;
+
+    if (p->flags & POOL_PIN)
+    {
+        unsigned long mask[POOL_CPU_WORDS] = {0};
+        mask[w->cpu / 64] = 1UL << (w->cpu % 64);
+        sys_sched_setaffinity(0, sizeof(mask), mask);
+    }
+
+    struct task t;
+    for (;;)
+    {
+        if (find_work(w, &t))
+        {
+            run_task(w, t);
+        }
+        else if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        else
+        {
+            park(p);
+        }
+    }
+    return 0;
+}
+
+// API
+
+long pool_init(struct pool *p, int nthreads, int flags)
+{
+    unsigned long mask[POOL_CPU_WORDS] = {0};
+    int cpus[POOL_MAX];
+    int ncpu = 0;
+
+    long got = sys_sched_getaffinity(0, sizeof(mask), mask);
+    for (long i = 0; got > 0 && i < got * 8 && ncpu < POOL_MAX; i++)
+    {
+        if (mask[i / 64] & (1UL << (i % 64))) cpus[ncpu++] = i;
+    }
+    if (ncpu == 0)
+    {
+        cpus[ncpu++] = 0;
+    }
+
+    int n = nthreads > 0 ? nthreads : ncpu;
+    if (n > POOL_MAX) n = POOL_MAX;
+
+    p->n = n;
+    p->flags = flags;
+    p->stop = 0;
+    p->seq = 0;
+    p->sleepers = 0;
+    p->done = 0;
+    p->map_size = (n * sizeof(struct pool_worker) + 4095) & ~4095L;
+    p->map = sys_mmap(0, p->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (SYS_MMAP_FAILED(p->map))
+    {
+        return (long)p->map;
+    }
+    p->workers = p->map;
+
+    for (int i = 0; i < n; i++)
+    {
+        struct pool_worker *w = &p->workers[i];
+        w->pool = p;
+        w->index = i;
+        w->cpu = cpus[i % ncpu];
+        w->rng = 0x9e3779b97f4a7c15UL * (i + 1);
+    }
+
+    // the caller is worker 0 and keeps its own affinity
+    self_worker = &p->workers[0];
+    for (int i = 1; i < n; i++)
+    {
+        long err = thread_create(&p->workers[i].thread, worker_main, &p->workers[i], 0);
+        if (err < 0)
+        {
+            p->n = i;
+            pool_free(p);
+            return err;
+        }
+    }
+    return 0;
+}
+
+void pool_free(struct pool *p)
+{
+    __atomic_store_n(&p->stop, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&p->seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&p->seq, 0x7fffffff);
+
+    for (int i = 1; i < p->n; i++)
+    {
+        thread_join(p->workers[i].thread);
+    }
+    if (self_worker && self_worker->pool == p)
+    {
+        self_worker = 0;
+    }
+    sys_munmap(p->map, p->map_size);
+    p->workers = 0;
+    p->n = 0;
+}
+
+void task_group_init(struct task_group *g, struct pool *p, pool_fn *fn, void *arg, long grain)
+{
+    g->pool = p;
+    g->fn = fn;
+    g->arg = arg;
+    g->grain = grain > 0 ? grain : 1;
+    g->pending = 0;
+}
+
+// Queued on the calling worker's deque. A thread that isn't one of the
+// pool's workers gets no deque and runs the range inline instead.
+void task_group_run(struct task_group *g, long lo, long hi)
+{
+    if (hi <= lo)
+    {
+        return;
+    }
+
+    struct pool_worker *w = self_worker;
+    if (!w || w->pool != g->pool || !spawn(w, g, lo, hi))
+    {
+        g->fn(g->arg, lo, hi);
+    }
+}
+
+void task_group_wait(struct task_group *g)
+{
+    struct pool_worker *w = self_worker;
+    if (w && w->pool != g->pool)
+    {
+        w = 0;
+    }
+
+    struct pool *p = g->pool;
+    struct task t;
+    while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) != 0)
+    {
+        // help out, and only sleep once there is nothing left to take
+        if (w && find_work(w, &t))
+        {
+            run_task(w, t);
+            continue;
+        }
+
+        // read the word before rechecking so a drain in between is seen
+        int done = __atomic_load_n(&p->done, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) != 0)
+        {
+            futex_wait(&p->done, done);
+        }
+    }
+}
+
+void parallel_for(struct pool *p, long lo, long hi, long grain, pool_fn *fn, void *arg)
+{
+    struct task_group g;
+    task_group_init(&g, p, fn, arg, grain);
+    task_group_run(&g, lo, hi);
+    task_group_wait(&g);
+}
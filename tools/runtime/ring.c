@@ -0,0 +1,336 @@
+// ring.c
+//
+// Bounded lock-free rings between threads.
+//
+// spsc is a byte ring for one producer and one consumer. Each side only
+// writes its own index and keeps a cached copy of the other one, so the
+// shared lines only move when the cache runs dry. reserve/commit and
+// peek/consume hand out contiguous spans for batching, spsc_write and
+// spsc_read are the copying versions.
+//
+// mpmc is Vyukov's bounded queue of pointers: every slot carries a
+// sequence number that says whose turn it is, so pushers and poppers
+// each need just one CAS on their index.
+//
+// Both sleep on a futex only when they have to. A waiter registers in
+// the event and then retries once before sleeping, the other side checks
+// for waiters after publishing, so the uncontended path makes no syscall.
+#include "sys.h"
+
+#define SPIN 64
+
+// event
+
+static int event_prepare(struct ring_event *e)
+{
+    __atomic_fetch_add(&e->waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&e->seq, __ATOMIC_SEQ_CST);
+}
+
+static void event_done(struct ring_event *e)
+{
+    __atomic_fetch_sub(&e->waiters, 1, __ATOMIC_RELAXED);
+}
+
+// one wake per publish: spsc has at most one waiter a side, and an mpmc
+// waiter that loses the message to a spinning thread just waits again
+static void event_signal(struct ring_event *e)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&e->waiters, __ATOMIC_RELAXED))
+    {
+        __atomic_fetch_add(&e->seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&e->seq, 1);
+    }
+}
+
+static void cpu_relax(void)
+{
+    asm volatile ("pause" ::: "memory");
+}
+
+// spsc
+
+void spsc_init(struct spsc *r, char *buf, long cap)
+{
+    r->tail = 0;
+    r->head_cache = 0;
+    r->head = 0;
+    r->tail_cache = 0;
+    r->data.seq = r->data.waiters = 0;
+    r->space.seq = r->space.waiters = 0;
+    r->closed = 0;
+    r->buf = buf;
+    r->cap = cap;
+}
+
+static long space_left(struct spsc *r)
+{
+    long free = r->cap - (r->tail - r->head_cache);
+    if (free == 0)
+    {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        free = r->cap - (r->tail - r->head_cache);
+    }
+    return free;
+}
+
+static long data_left(struct spsc *r)
+{
+    long used = r->tail_cache - r->head;
+    if (used == 0)
+    {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        used = r->tail_cache - r->head;
+    }
+    return used;
+}
+
+long spsc_reserve(struct spsc *r, char **p)
+{
+    long free = space_left(r);
+    long at = r->tail & (r->cap - 1);
+    if (free > r->cap - at) free = r->cap - at;
+    *p = r->buf + at;
+    return free;
+}
+
+void spsc_commit(struct spsc *r, long n)
+{
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+    event_signal(&r->data);
+}
+
+long spsc_peek(struct spsc *r, const char **p)
+{
+    long used = data_left(r);
+    long at = r->head & (r->cap - 1);
+    if (used > r->cap - at) used = r->cap - at;
+    *p = r->buf + at;
+    return used;
+}
+
+void spsc_consume(struct spsc *r, long n)
+{
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+    event_signal(&r->space);
+}
+
+void spsc_close(struct spsc *r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    event_signal(&r->data);
+}
+
+// The caches only help the fast path; waiting always looks at the real
+// index so it can't sleep on stale news.
+long spsc_wait_space(struct spsc *r, long n)
+{
+    if (n > r->cap) n = r->cap;
+    for (int spin = 0; ; spin++)
+    {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        long free = r->cap - (r->tail - r->head_cache);
+        if (free >= n) return free;
+        if (spin < SPIN)
+        {
+            cpu_relax();
+            continue;
+        }
+
+        int seq = event_prepare(&r->space);
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+        if (r->cap - (r->tail - r->head_cache) < n)
+        {
+            futex_wait(&r->space.seq, seq);
+        }
+        event_done(&r->space);
+    }
+}
+
+// returns early with whatever is left once the producer has closed
+long spsc_wait_data(struct spsc *r, long n)
+{
+    if (n > r->cap) n = r->cap;
+    for (int spin = 0; ; spin++)
+    {
+        int closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        long used = r->tail_cache - r->head;
+        if (used >= n || closed) return used;
+        if (spin < SPIN)
+        {
+            cpu_relax();
+            continue;
+        }
+
+        int seq = event_prepare(&r->data);
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+        if (r->tail_cache - r->head < n && !__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST))
+        {
+            futex_wait(&r->data.seq, seq);
+        }
+        event_done(&r->data);
+    }
+}
+
+void spsc_write(struct spsc *r, const void *p, long n)
+{
+    const char *src = p;
+    while (n > 0)
+    {
+        char *dst;
+        long room = spsc_reserve(r, &dst);
+        if (room == 0)
+        {
+            spsc_wait_space(r, 1);
+            continue;
+        }
+        if (room > n) room = n;
+        memcpy(dst, src, room);
+        spsc_commit(r, room);
+        src += room;
+        n -= room;
+    }
+}
+
+// blocks until there is something, 0 means closed and drained
+long spsc_read(struct spsc *r, void *p, long n)
+{
+    char *dst = p;
+    long got = 0;
+
+    if (spsc_wait_data(r, 1) == 0)
+    {
+        return 0;
+    }
+    while (got < n)
+    {
+        const char *src;
+        long avail = spsc_peek(r, &src);
+        if (avail == 0) break;
+        if (avail > n - got) avail = n - got;
+        memcpy(dst + got, src, avail);
+        spsc_consume(r, avail);
+        got += avail;
+    }
+    return got;
+}
+
+// mpmc
+
+void mpmc_init(struct mpmc *q, struct mpmc_slot *slots, long cap)
+{
+    q->head = 0;
+    q->tail = 0;
+    q->not_empty.seq = q->not_empty.waiters = 0;
+    q->not_full.seq = q->not_full.waiters = 0;
+    q->slots = slots;
+    q->mask = cap - 1;
+    for (long i = 0; i < cap; i++)
+    {
+        slots[i].seq = i;
+    }
+}
+
+// A slot is free for the pusher at position pos when its seq is pos, and
+// holds a message for the popper at pos when its seq is pos + 1.
+int mpmc_trypush(struct mpmc *q, void *msg)
+{
+    long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        struct mpmc_slot *s = &q->slots[pos & q->mask];
+        long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        long diff = seq - pos;
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                s->msg = msg;
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                event_signal(&q->not_empty);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;       // full
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int mpmc_trypop(struct mpmc *q, void **msg)
+{
+    long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        struct mpmc_slot *s = &q->slots[pos & q->mask];
+        long seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        long diff = seq - (pos + 1);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *msg = s->msg;
+                __atomic_store_n(&s->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                event_signal(&q->not_full);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;       // empty
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void mpmc_push(struct mpmc *q, void *msg)
+{
+    for (int spin = 0; !mpmc_trypush(q, msg); spin++)
+    {
+        if (spin < SPIN)
+        {
+            cpu_relax();
+            continue;
+        }
+        int seq = event_prepare(&q->not_full);
+        if (mpmc_trypush(q, msg))
+        {
+            event_done(&q->not_full);
+            return;
+        }
+        futex_wait(&q->not_full.seq, seq);
+        event_done(&q->not_full);
+    }
+}
+
+void *mpmc_pop(struct mpmc *q)
+{
+    void *msg;
+    for (int spin = 0; !mpmc_trypop(q, &msg); spin++)
+    {
+        if (spin < SPIN)
+        {
+            cpu_relax();
+            continue;
+        }
+        int seq = event_prepare(&q->not_empty);
+        if (mpmc_trypop(q, &msg))
+        {
+            event_done(&q->not_empty);
+            return msg;
+        }
+        futex_wait(&q->not_empty.seq, seq);
+        event_done(&q->not_empty);
+    }
+    return msg;
+}
@@ -1,18 +1,104 @@
 // start.c
 #include "sys.h"
 
-// No prologue
-__attribute__((naked))
+// Filled in by the linker from the .preinit_array/.init_array/.fini_array
+// sections, which is where gcc puts __attribute__((constructor)) and
+// __attribute__((destructor)) functions.
+typedef void (*init_fn)(int argc, char **argv, char **envp);
+typedef void (*fini_fn)(void);
+
+extern init_fn __preinit_array_start[] __attribute__((weak));
+extern init_fn __preinit_array_end[]   __attribute__((weak));
+extern init_fn __init_array_start[]    __attribute__((weak));
+extern init_fn __init_array_end[]      __attribute__((weak));
+extern fini_fn __fini_array_start[]    __attribute__((weak));
+extern fini_fn __fini_array_end[]      __attribute__((weak));
+
+#define MAX_ATEXIT 32
+
+static fini_fn atexit_fns[MAX_ATEXIT];
+static int     atexit_count;
+
+int rt_atexit(fini_fn fn)
+{
+    if (atexit_count == MAX_ATEXIT)
+    {
+        return -1;
+    }
+    atexit_fns[atexit_count++] = fn;
+    return 0;
+}
+
+// The one way out of the process: atexit handlers and destructors in
+// reverse order, then whatever is still in the output streams, then the
+// trace if there is one.
+__attribute__((noreturn))
+void rt_exit(int code)
+{
+    while (atexit_count > 0)
+    {
+        atexit_fns[--atexit_count]();
+    }
+
+    for (fini_fn *f = __fini_array_end; f > __fini_array_start; )
+    {
+        (*--f)();
+    }
+
+    if (out_flush_all() < 0 && code == 0)
+    {
+        code = 1;
+    }
+
+#ifdef RT_TRACE
+    trace_dump();
+#endif
+
+    sys_exit_group(code);
+}
+
+// The C side of _start: decode the initial stack, find the vDSO, pick the
+// kernels for this CPU, set up the main thread's TLS, run constructors,
+// run the tool, and leave through rt_exit.
+__attribute__((noreturn))
+void start_main(uintptr_t *rsp)
+{
+    startup_parse(rsp);
+    vdso_init();
+    cpu_init();
+    thread_init();
+#ifdef RT_TRACE
+    trace_init();
+#endif
+
+    // constructors may already use anything above
+    for (init_fn *f = __preinit_array_start; f < __preinit_array_end; f++)
+    {
+        (*f)(startup.argc, startup.argv, startup.envp);
+    }
+    for (init_fn *f = __init_array_start; f < __init_array_end; f++)
+    {
+        (*f)(startup.argc, startup.argv, startup.envp);
+    }
+
+    rt_exit(main_start(rsp));
+}
+
+// The kernel enters here with rsp pointing at argc. The ABI wants rsp
+// 16-byte aligned at a call instruction; the kernel already gives us
+// that, but we force it rather than depend on it, since a single
+// misaligned frame is enough to crash any movaps spill. rbp is zeroed
+// so debuggers and unwinders know where the frame chain ends.
+__attribute__((naked, noreturn))
 void _start(void) {
     asm volatile (
-        "mov %%rsp, %%rdi\n\t"    // pass rsp to main_start
-        "call main_start\n\t"     // call C logic
-        "mov %%rax, %%rdi\n\t"    // exit code
-        "mov $60, %%rax\n\t"      // sys_exit
-        "syscall"
+        "xor %%ebp, %%ebp\n\t"    // outermost frame
+        "mov %%rsp, %%rdi\n\t"    // pass rsp to start_main
+        "and $-16, %%rsp\n\t"     // align for the call
+        "call start_main\n\t"     // never returns
+        "hlt"
         :
         :
-        : "rdi", "rax"
+        : "memory"
     );
-    // __builtin_unreachable();
 }
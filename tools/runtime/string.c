@@ -0,0 +1,466 @@
+// string.c
+//
+// strlen, strcmp, memchr, memcpy, memmove and memset for the runtime.
+// gcc emits calls to the mem* ones on its own even under -nostdlib, so
+// these have to exist under their standard names.
+//
+// Each comes as a scalar loop, an SSE2 version (every x86-64 has it), an
+// AVX2 version and, for all but strcmp, an AVX-512BW version; cpu.c picks
+// one at startup. The scanning ones read whole aligned vectors, which
+// can run past the end of the string but never past the end of the page
+// it's on, so they can't fault where a byte loop wouldn't.
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "sys.h"
+
+// Keep gcc from turning the scalar loops below back into calls to the
+// very functions they implement.
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+#define AVX2        __attribute__((target("avx2")))
+#define AVX512      __attribute__((target("avx512f,avx512bw")))
+
+#define PAGE 4096UL
+
+// will a `size`-byte load at p stay on p's page?
+static inline int same_page(const void *p, unsigned long size)
+{
+    return ((unsigned long)p & (PAGE - 1)) <= PAGE - size;
+}
+
+// scalar
+
+NO_LIBCALLS size_t strlen_scalar(const char *s)
+{
+    const char *p = s;
+    while (*p) p++;
+    return p - s;
+}
+
+NO_LIBCALLS int strcmp_scalar(const char *a, const char *b)
+{
+    while (*a && (*a == *b))
+    {
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+NO_LIBCALLS void *memchr_scalar(const void *s, int c, size_t n)
+{
+    const unsigned char *p = s;
+    for (; n; n--, p++)
+    {
+        if (*p == (unsigned char)c) return (void *)p;
+    }
+    return 0;
+}
+
+NO_LIBCALLS void *memcpy_scalar(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+    while (n--) *d++ = *s++;
+    return dst;
+}
+
+NO_LIBCALLS void *memset_scalar(void *dst, int c, size_t n)
+{
+    char *d = dst;
+    while (n--) *d++ = (char)c;
+    return dst;
+}
+
+// SSE2
+
+size_t strlen_sse2(const char *s)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // first aligned block, ignoring the bytes in it before s
+    const char *p = (const char *)((unsigned long)s & ~15UL);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+    mask >>= s - p;
+    if (mask)
+    {
+        return __builtin_ctz(mask);
+    }
+
+    while (1)
+    {
+        p += 16;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask) - s;
+        }
+    }
+}
+
+int strcmp_sse2(const char *a, const char *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    while (1)
+    {
+        // the two strings are rarely aligned the same way, so step byte by
+        // byte whenever either load would cross into the next page
+        if (!same_page(a, 16) || !same_page(b, 16))
+        {
+            if (*a != *b || !*a)
+            {
+                return (unsigned char)*a - (unsigned char)*b;
+            }
+            a++;
+            b++;
+            continue;
+        }
+
+        __m128i va = _mm_loadu_si128((const __m128i *)a);
+        __m128i vb = _mm_loadu_si128((const __m128i *)b);
+        unsigned stop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(va, zero),
+                                                       _mm_xor_si128(_mm_cmpeq_epi8(va, vb), _mm_set1_epi8(-1))));
+        if (stop)
+        {
+            int i = __builtin_ctz(stop);
+            return (unsigned char)a[i] - (unsigned char)b[i];
+        }
+        a += 16;
+        b += 16;
+    }
+}
+
+void *memchr_sse2(const void *s, int c, size_t n)
+{
+    if (!n)
+    {
+        return 0;
+    }
+
+    const __m128i needle = _mm_set1_epi8((char)c);
+    const unsigned char *start = s;
+    const unsigned char *end = start + n;
+
+    const unsigned char *p = (const unsigned char *)((unsigned long)start & ~15UL);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), needle));
+    mask &= 0xffffu << (start - p);
+
+    while (1)
+    {
+        if (mask)
+        {
+            const unsigned char *hit = p + __builtin_ctz(mask);
+            return hit < end ? (void *)hit : 0;
+        }
+        p += 16;
+        if (p >= end)
+        {
+            return 0;
+        }
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), needle));
+    }
+}
+
+NO_LIBCALLS void *memcpy_sse2(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+
+    if (n < 16)
+    {
+        return memcpy_scalar(dst, src, n);
+    }
+
+    // the last block may overlap the one before it, that's fine
+    __m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+    for (size_t i = 0; i + 16 <= n; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(d + i), _mm_loadu_si128((const __m128i *)(s + i)));
+    }
+    _mm_storeu_si128((__m128i *)(d + n - 16), tail);
+    return dst;
+}
+
+NO_LIBCALLS void *memset_sse2(void *dst, int c, size_t n)
+{
+    char *d = dst;
+
+    if (n < 16)
+    {
+        return memset_scalar(dst, c, n);
+    }
+
+    __m128i v = _mm_set1_epi8((char)c);
+    for (size_t i = 0; i + 16 <= n; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(d + i), v);
+    }
+    _mm_storeu_si128((__m128i *)(d + n - 16), v);
+    return dst;
+}
+
+// AVX2
+
+AVX2 size_t strlen_avx2(const char *s)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    const char *p = (const char *)((unsigned long)s & ~31UL);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+    mask >>= s - p;
+    if (mask)
+    {
+        return __builtin_ctz(mask);
+    }
+
+    while (1)
+    {
+        p += 32;
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask) - s;
+        }
+    }
+}
+
+AVX2 int strcmp_avx2(const char *a, const char *b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (1)
+    {
+        if (!same_page(a, 32) || !same_page(b, 32))
+        {
+            if (*a != *b || !*a)
+            {
+                return (unsigned char)*a - (unsigned char)*b;
+            }
+            a++;
+            b++;
+            continue;
+        }
+
+        __m256i va = _mm256_loadu_si256((const __m256i *)a);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)b);
+        unsigned stop = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(va, zero),
+                                                             _mm256_xor_si256(_mm256_cmpeq_epi8(va, vb), _mm256_set1_epi8(-1))));
+        if (stop)
+        {
+            int i = __builtin_ctz(stop);
+            return (unsigned char)a[i] - (unsigned char)b[i];
+        }
+        a += 32;
+        b += 32;
+    }
+}
+
+AVX2 void *memchr_avx2(const void *s, int c, size_t n)
+{
+    if (!n)
+    {
+        return 0;
+    }
+
+    const __m256i needle = _mm256_set1_epi8((char)c);
+    const unsigned char *start = s;
+    const unsigned char *end = start + n;
+
+    const unsigned char *p = (const unsigned char *)((unsigned long)start & ~31UL);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), needle));
+    mask &= 0xffffffffu << (start - p);
+
+    while (1)
+    {
+        if (mask)
+        {
+            const unsigned char *hit = p + __builtin_ctz(mask);
+            return hit < end ? (void *)hit : 0;
+        }
+        p += 32;
+        if (p >= end)
+        {
+            return 0;
+        }
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), needle));
+    }
+}
+
+AVX2 NO_LIBCALLS void *memcpy_avx2(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+
+    if (n < 32)
+    {
+        return memcpy_sse2(dst, src, n);
+    }
+
+    __m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+    for (size_t i = 0; i + 32 <= n; i += 32)
+    {
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_loadu_si256((const __m256i *)(s + i)));
+    }
+    _mm256_storeu_si256((__m256i *)(d + n - 32), tail);
+    return dst;
+}
+
+AVX2 NO_LIBCALLS void *memset_avx2(void *dst, int c, size_t n)
+{
+    char *d = dst;
+
+    if (n < 32)
+    {
+        return memset_sse2(dst, c, n);
+    }
+
+    __m256i v = _mm256_set1_epi8((char)c);
+    for (size_t i = 0; i + 32 <= n; i += 32)
+    {
+        _mm256_storeu_si256((__m256i *)(d + i), v);
+    }
+    _mm256_storeu_si256((__m256i *)(d + n - 32), v);
+    return dst;
+}
+
+// AVX-512BW
+
+AVX512 size_t strlen_avx512(const char *s)
+{
+    const __m512i zero = _mm512_setzero_si512();
+
+    const char *p = (const char *)((unsigned long)s & ~63UL);
+    unsigned long mask = _mm512_cmpeq_epi8_mask(_mm512_load_si512(p), zero);
+    mask >>= s - p;
+    if (mask)
+    {
+        return __builtin_ctzl(mask);
+    }
+
+    while (1)
+    {
+        p += 64;
+        mask = _mm512_cmpeq_epi8_mask(_mm512_load_si512(p), zero);
+        if (mask)
+        {
+            return p + __builtin_ctzl(mask) - s;
+        }
+    }
+}
+
+AVX512 void *memchr_avx512(const void *s, int c, size_t n)
+{
+    if (!n)
+    {
+        return 0;
+    }
+
+    const __m512i needle = _mm512_set1_epi8((char)c);
+    const unsigned char *start = s;
+    const unsigned char *end = start + n;
+
+    const unsigned char *p = (const unsigned char *)((unsigned long)start & ~63UL);
+    unsigned long mask = _mm512_cmpeq_epi8_mask(_mm512_load_si512(p), needle);
+    mask &= ~0UL << (start - p);
+
+    while (1)
+    {
+        if (mask)
+        {
+            const unsigned char *hit = p + __builtin_ctzl(mask);
+            return hit < end ? (void *)hit : 0;
+        }
+        p += 64;
+        if (p >= end)
+        {
+            return 0;
+        }
+        mask = _mm512_cmpeq_epi8_mask(_mm512_load_si512(p), needle);
+    }
+}
+
+// masked loads and stores don't fault on the bytes they leave out, so
+// short copies need no scalar tail at all
+AVX512 NO_LIBCALLS void *memcpy_avx512(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+
+    if (n < 64)
+    {
+        __mmask64 m = n ? ~0UL >> (64 - n) : 0;
+        _mm512_mask_storeu_epi8(d, m, _mm512_maskz_loadu_epi8(m, s));
+        return dst;
+    }
+
+    __m512i tail = _mm512_loadu_si512(s + n - 64);
+    for (size_t i = 0; i + 64 <= n; i += 64)
+    {
+        _mm512_storeu_si512(d + i, _mm512_loadu_si512(s + i));
+    }
+    _mm512_storeu_si512(d + n - 64, tail);
+    return dst;
+}
+
+AVX512 NO_LIBCALLS void *memset_avx512(void *dst, int c, size_t n)
+{
+    char *d = dst;
+    __m512i v = _mm512_set1_epi8((char)c);
+
+    if (n < 64)
+    {
+        __mmask64 m = n ? ~0UL >> (64 - n) : 0;
+        _mm512_mask_storeu_epi8(d, m, v);
+        return dst;
+    }
+
+    for (size_t i = 0; i + 64 <= n; i += 64)
+    {
+        _mm512_storeu_si512(d + i, v);
+    }
+    _mm512_storeu_si512(d + n - 64, v);
+    return dst;
+}
+
+// The public names go through the table cpu_init fills in. Until it runs
+// (and in anything that never calls it) they use the SSE2 versions.
+
+size_t strlen(const char *s)
+{
+    return kernels.strlen(s);
+}
+
+int strcmp(const char *a, const char *b)
+{
+    return kernels.strcmp(a, b);
+}
+
+void *memchr(const void *s, int c, size_t n)
+{
+    return kernels.memchr(s, c, n);
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+    return kernels.memcpy(dst, src, n);
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+    return kernels.memset(dst, c, n);
+}
+
+// gcc can emit memmove too; overlap only matters when dst is ahead of src
+NO_LIBCALLS void *memmove(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+
+    if (d <= s || d >= s + n)
+    {
+        return memcpy(dst, src, n);
+    }
+    while (n--) d[n] = s[n];
+    return dst;
+}
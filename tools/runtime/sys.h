@@ -2,32 +2,936 @@
 #define _FAILBOT_SYS_H
 
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #define STDIN  0
 #define STDOUT 1
 #define STDERR 2
 
+// every tool provides this, _start calls it with the initial stack
+long main_start(uintptr_t *rsp);
+
+// Process exit (start.c)
+//
+// Returning from main_start goes through rt_exit as well. It runs the
+// rt_atexit handlers and destructors in reverse order, flushes the output
+// streams and exits the whole process.
+__attribute__((noreturn)) void rt_exit(int code);
+int rt_atexit(void (*fn)(void));
+
+static inline unsigned long rdtsc(void)
+{
+    unsigned lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+// Tracing (trace.c)
+//
+// Built with -DRT_TRACE every syscall below and every TRACE_SPAN is
+// recorded with its rdtsc start and end into a per-thread mmap'd ring,
+// and rt_exit dumps them to trace.<pid>.bin (or $RT_TRACE_FILE).
+// tools/trace2json turns that into Chrome trace JSON. Without RT_TRACE
+// the hooks compile to nothing.
+#define TRACE_SYSCALL 1
+#define TRACE_SPAN    2
+
+struct trace_event            // 64 bytes, also the on-disk format
+{
+    unsigned long start;      // rdtsc
+    unsigned long end;
+    int  kind;
+    int  nr;                  // syscall number
+    long ret;
+    union
+    {
+        long arg[4];          // first syscall arguments
+        char name[32];        // span name, cut to fit
+    };
+};
+
+// trace file: a trace_file header, then per thread a trace_thread
+// followed by its events, oldest first
+struct trace_file
+{
+    char magic[8];            // "RTTRACE1"
+    unsigned long tsc_start;  // rdtsc and CLOCK_MONOTONIC read together at
+    unsigned long ns_start;   // trace_init and again at the dump, to turn
+    unsigned long tsc_end;    // ticks into time
+    unsigned long ns_end;
+    int pid;
+    int nthreads;
+};
+
+struct trace_thread
+{
+    int  tid;
+    int  pad;
+    long nevents;             // in the file; older ones were overwritten
+    long dropped;
+};
+
+void trace_init(void);
+void trace_dump(void);
+void trace_syscall(long nr, long a1, long a2, long a3, long a4, long ret, unsigned long start);
+void trace_span(const char *name, unsigned long start);
+
+#ifdef RT_TRACE
+#define TRACE_BEGIN()                     unsigned long trace_t0 = rdtsc()
+#define TRACE_END(n, a1, a2, a3, a4, ret) trace_syscall(n, a1, a2, a3, a4, ret, trace_t0)
+#define TRACE_SPAN_BEGIN(var)             unsigned long var = rdtsc()
+#define TRACE_SPAN_END(var, name)         trace_span(name, var)
+#else
+#define TRACE_BEGIN()
+#define TRACE_END(n, a1, a2, a3, a4, ret)
+#define TRACE_SPAN_BEGIN(var)
+#define TRACE_SPAN_END(var, name)
+#endif
+
+// Raw syscalls
+//
+// Everything here is static inline so the wrappers fold into the caller's
+// loop instead of costing a call each. Arguments go in rdi, rsi, rdx, r10,
+// r8, r9 (see notes/asm_x86_64.txt); the kernel clobbers rcx and r11.
+// Errors come back as -errno, there's no errno variable. The trace hooks
+// sit outside the register variables so their call can't clobber them.
+static inline long syscall0(long n)
+{
+    TRACE_BEGIN();
+    long ret;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, 0, 0, 0, 0, ret);
+    return(ret);
+}
+
+static inline long syscall1(long n, long a1)
+{
+    TRACE_BEGIN();
+    long ret;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n), "D"(a1)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, a1, 0, 0, 0, ret);
+    return(ret);
+}
+
+static inline long syscall2(long n, long a1, long a2)
+{
+    TRACE_BEGIN();
+    long ret;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n), "D"(a1), "S"(a2)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, a1, a2, 0, 0, ret);
+    return(ret);
+}
+
+static inline long syscall3(long n, long a1, long a2, long a3)
+{
+    TRACE_BEGIN();
+    long ret;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n), "D"(a1), "S"(a2), "d"(a3)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, a1, a2, a3, 0, ret);
+    return(ret);
+}
+
+// there are no constraint letters for r8-r10, so those go through
+// register variables
+static inline long syscall4(long n, long a1, long a2, long a3, long a4)
+{
+    TRACE_BEGIN();
+    long ret;
+    register long r10 __asm__("r10") = a4;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n), "D"(a1), "S"(a2), "d"(a3), "r"(r10)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, a1, a2, a3, a4, ret);
+    return(ret);
+}
+
+static inline long syscall5(long n, long a1, long a2, long a3, long a4, long a5)
+{
+    TRACE_BEGIN();
+    long ret;
+    register long r10 __asm__("r10") = a4;
+    register long r8  __asm__("r8")  = a5;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, a1, a2, a3, a4, ret);
+    return(ret);
+}
+
+static inline long syscall6(long n, long a1, long a2, long a3, long a4, long a5, long a6)
+{
+    TRACE_BEGIN();
+    long ret;
+    register long r10 __asm__("r10") = a4;
+    register long r8  __asm__("r8")  = a5;
+    register long r9  __asm__("r9")  = a6;
+    asm volatile ("syscall"
+                  : "=a"(ret)
+                  : "a"(n), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8), "r"(r9)
+                  : "rcx", "r11", "memory");
+    TRACE_END(n, a1, a2, a3, a4, ret);
+    return(ret);
+}
+
 // sys calls
-long sys_write(int fd, const void *buf, long count);
-long sys_read(int fd, const void *buf, long count);
-long sys_open(const char *pathname, long flags, long mode);
-void sys_exit(int code);
 
-// strings
-static long strlen(const char *s)
+// files
+static inline long sys_read(int fd, void *buf, long count)
+{
+    return syscall3(SYS_read, fd, (long)buf, count);
+}
+
+static inline long sys_write(int fd, const void *buf, long count)
+{
+    return syscall3(SYS_write, fd, (long)buf, count);
+}
+
+static inline long sys_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    return syscall3(SYS_readv, fd, (long)iov, iovcnt);
+}
+
+static inline long sys_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return syscall3(SYS_writev, fd, (long)iov, iovcnt);
+}
+
+static inline long sys_pread(int fd, void *buf, long count, long offset)
+{
+    return syscall4(SYS_pread64, fd, (long)buf, count, offset);
+}
+
+static inline long sys_pwrite(int fd, const void *buf, long count, long offset)
 {
-    const char *p = s;
-    while(*p) p++;
-    return p - s;
+    return syscall4(SYS_pwrite64, fd, (long)buf, count, offset);
 }
 
-static long _strcmp(const char *a, const char *b)
+static inline long sys_open(const char *pathname, long flags, long mode)
 {
-    while (*a && (*a == *b)) {
-        a++;
-        b++;
-    }
-    return (unsigned char)*a - (unsigned char)*b;
+    return syscall4(SYS_openat, AT_FDCWD, (long)pathname, flags, mode);
 }
 
+static inline long sys_close(int fd)
+{
+    return syscall1(SYS_close, fd);
+}
+
+static inline long sys_fstat(int fd, struct stat *st)
+{
+    return syscall2(SYS_fstat, fd, (long)st);
+}
+
+static inline long sys_lseek(int fd, long offset, int whence)
+{
+    return syscall3(SYS_lseek, fd, offset, whence);
+}
+
+static inline long sys_unlink(const char *pathname)
+{
+    return syscall1(SYS_unlink, (long)pathname);
+}
+
+static inline long sys_dup(int fd)
+{
+    return syscall1(SYS_dup, fd);
+}
+
+static inline long sys_dup3(int oldfd, int newfd, int flags)
+{
+    return syscall3(SYS_dup3, oldfd, newfd, flags);
+}
+
+static inline long sys_pipe2(int fds[2], int flags)
+{
+    return syscall2(SYS_pipe2, (long)fds, flags);
+}
+
+static inline long sys_fcntl(int fd, int cmd, long arg)
+{
+    return syscall3(SYS_fcntl, fd, cmd, arg);
+}
+
+static inline long sys_ioctl(int fd, unsigned long request, long arg)
+{
+    return syscall3(SYS_ioctl, fd, request, arg);
+}
+
+static inline long sys_fadvise(int fd, long offset, long len, int advice)
+{
+    return syscall4(SYS_fadvise64, fd, offset, len, advice);
+}
+
+static inline long sys_readahead(int fd, long offset, long count)
+{
+    return syscall3(SYS_readahead, fd, offset, count);
+}
+
+// in-kernel copies
+static inline long sys_sendfile(int out_fd, int in_fd, long *offset, long count)
+{
+    return syscall4(SYS_sendfile, out_fd, in_fd, (long)offset, count);
+}
+
+static inline long sys_splice(int fd_in, long *off_in, int fd_out, long *off_out, long len, unsigned int flags)
+{
+    return syscall6(SYS_splice, fd_in, (long)off_in, fd_out, (long)off_out, len, flags);
+}
+
+static inline long sys_copy_file_range(int fd_in, long *off_in, int fd_out, long *off_out, long len, unsigned int flags)
+{
+    return syscall6(SYS_copy_file_range, fd_in, (long)off_in, fd_out, (long)off_out, len, flags);
+}
+
+// memory
+static inline void *sys_mmap(void *addr, long length, long prot, long flags, int fd, long offset)
+{
+    return (void *)syscall6(SYS_mmap, (long)addr, length, prot, flags, fd, offset);
+}
+
+static inline long sys_munmap(void *addr, long length)
+{
+    return syscall2(SYS_munmap, (long)addr, length);
+}
+
+static inline long sys_mprotect(void *addr, long length, long prot)
+{
+    return syscall3(SYS_mprotect, (long)addr, length, prot);
+}
+
+static inline long sys_madvise(void *addr, long length, int advice)
+{
+    return syscall3(SYS_madvise, (long)addr, length, advice);
+}
+
+// io_uring
+static inline long sys_io_uring_setup(unsigned int entries, void *params)
+{
+    return syscall2(SYS_io_uring_setup, entries, (long)params);
+}
+
+static inline long sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall6(SYS_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static inline long sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall4(SYS_io_uring_register, fd, opcode, (long)arg, nr_args);
+}
+
+// event loop plumbing
+static inline long sys_epoll_create1(int flags)
+{
+    return syscall1(SYS_epoll_create1, flags);
+}
+
+static inline long sys_epoll_ctl(int epfd, int op, int fd, void *event)
+{
+    return syscall4(SYS_epoll_ctl, epfd, op, fd, (long)event);
+}
+
+static inline long sys_epoll_wait(int epfd, void *events, int maxevents, int timeout_ms)
+{
+    return syscall4(SYS_epoll_wait, epfd, (long)events, maxevents, timeout_ms);
+}
+
+static inline long sys_timerfd_create(int clock, int flags)
+{
+    return syscall2(SYS_timerfd_create, clock, flags);
+}
+
+static inline long sys_timerfd_settime(int fd, int flags, const void *new_value, void *old_value)
+{
+    return syscall4(SYS_timerfd_settime, fd, flags, (long)new_value, (long)old_value);
+}
+
+// the kernel's sigset is one unsigned long, not glibc's 128 bytes
+static inline long sys_signalfd4(int fd, const unsigned long *mask, int flags)
+{
+    return syscall4(SYS_signalfd4, fd, (long)mask, sizeof(*mask), flags);
+}
+
+static inline long sys_rt_sigprocmask(int how, const unsigned long *set, unsigned long *old)
+{
+    return syscall4(SYS_rt_sigprocmask, how, (long)set, (long)old, sizeof(*set));
+}
+
+// processes and time
+static inline long sys_getpid(void)
+{
+    return syscall0(SYS_getpid);
+}
+
+static inline long sys_gettid(void)
+{
+    return syscall0(SYS_gettid);
+}
+
+static inline long sys_fork(void)
+{
+    return syscall0(SYS_fork);
+}
+
+static inline long sys_execve(const char *path, char *const argv[], char *const envp[])
+{
+    return syscall3(SYS_execve, (long)path, (long)argv, (long)envp);
+}
+
+static inline long sys_wait4(int pid, int *status, int options, void *rusage)
+{
+    return syscall4(SYS_wait4, pid, (long)status, options, (long)rusage);
+}
+
+static inline long sys_kill(int pid, int sig)
+{
+    return syscall2(SYS_kill, pid, sig);
+}
+
+static inline long sys_sched_yield(void)
+{
+    return syscall0(SYS_sched_yield);
+}
+
+static inline long sys_sched_setaffinity(int pid, long size, const unsigned long *mask)
+{
+    return syscall3(SYS_sched_setaffinity, pid, size, (long)mask);
+}
+
+// returns the number of mask bytes the kernel filled in
+static inline long sys_sched_getaffinity(int pid, long size, unsigned long *mask)
+{
+    return syscall3(SYS_sched_getaffinity, pid, size, (long)mask);
+}
+
+static inline long sys_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    return syscall2(SYS_nanosleep, (long)req, (long)rem);
+}
+
+static inline long sys_clock_gettime(int clock, struct timespec *ts)
+{
+    return syscall2(SYS_clock_gettime, clock, (long)ts);
+}
+
+static inline long sys_futex(int *uaddr, int op, int val, const struct timespec *timeout, int *uaddr2, int val3)
+{
+    return syscall6(SYS_futex, (long)uaddr, op, val, (long)timeout, (long)uaddr2, val3);
+}
+
+static inline long sys_arch_prctl(int code, unsigned long addr)
+{
+    return syscall2(SYS_arch_prctl, code, addr);
+}
+
+static inline long sys_gettimeofday(struct timeval *tv, void *tz)
+{
+    return syscall2(SYS_gettimeofday, (long)tv, (long)tz);
+}
+
+static inline long sys_getcpu(unsigned *cpu, unsigned *node)
+{
+    return syscall3(SYS_getcpu, (long)cpu, (long)node, 0);
+}
+
+__attribute__((noreturn))
+static inline void sys_exit(int code)
+{
+    syscall1(SYS_exit, code);
+    __builtin_unreachable();
+}
+
+__attribute__((noreturn))
+static inline void sys_exit_group(int code)
+{
+    syscall1(SYS_exit_group, code);
+    __builtin_unreachable();
+}
+
+// mmap returns -errno in the pointer on failure
+#define SYS_MMAP_FAILED(p) ((unsigned long)(p) > -4096UL)
+
+// Arenas (arena.c)
+//
+// Bump allocation out of mmap'd regions. When a region fills up another
+// one is mapped and chained in front of it; nothing is ever freed on its
+// own, only by rolling back to a mark or resetting the whole arena.
+// Memory handed out after a rollback is not zeroed.
+#define ARENA_HUGEPAGE  1   // madvise(MADV_HUGEPAGE) regions of 2 MiB and up
+
+struct arena_region
+{
+    struct arena_region *prev;
+    long size;              // whole mapping, header included
+    long used;              // offset of the next free byte
+};
+
+struct arena
+{
+    struct arena_region *cur;
+    long region_size;       // minimum size of a new region
+    int  flags;
+};
+
+struct arena_mark
+{
+    struct arena_region *region;
+    long used;
+};
+
+void  arena_init(struct arena *a, long region_size, int flags);
+void *arena_alloc(struct arena *a, long size);   // 16-byte aligned, 0 when out of memory
+void *arena_alloc_aligned(struct arena *a, long size, long align);
+struct arena_mark arena_mark(struct arena *a);
+void  arena_rollback(struct arena *a, struct arena_mark m);
+void  arena_reset(struct arena *a);              // keeps the first region mapped
+void  arena_free(struct arena *a);
+
+// Process startup (auxv.c)
+//
+// start_main fills `startup` in from the initial stack before main_start
+// runs, tools can keep decoding rsp themselves or use this.
+struct startup
+{
+    long   argc;
+    char **argv;
+    char **envp;
+    unsigned long *auxv;     // (AT_* type, value) pairs, AT_NULL terminated
+};
+
+extern struct startup startup;
+
+void startup_parse(uintptr_t *rsp);
+unsigned long auxv_get(unsigned long type);   // 0 when absent
+char *env_get(const char *name);              // 0 when unset
+int   env_flag(const char *name);             // set, non-empty and not "0"
+
+// vDSO (vdso.c)
+//
+// Entry points resolved out of the kernel's vDSO at startup, 0 where the
+// kernel doesn't export one. They return int (0 or -errno), which the
+// _fast wrappers widen to long; those fall back to the syscall.
+struct vdso
+{
+    int (*clock_gettime)(int clock, struct timespec *ts);
+    int (*gettimeofday)(struct timeval *tv, void *tz);
+    int (*getcpu)(unsigned *cpu, unsigned *node, void *unused);
+};
+
+extern struct vdso vdso;
+
+void vdso_init(void);
+long clock_gettime_fast(int clock, struct timespec *ts);
+long gettimeofday_fast(struct timeval *tv);
+long getcpu_fast(unsigned *cpu, unsigned *node);
+
+// Threads (thread.c)
+//
+// clone(2) threads with a guard-paged stack and their own TLS block, so
+// __thread variables work. start_main sets the main thread up the same
+// way. Nothing else in the runtime (out, arena) locks, so don't share
+// those between threads without a mutex.
+struct thread
+{
+    struct thread *self;      // %fs:0, how gcc finds the thread pointer
+    void *dtv;                // unused, keeps the usual TCB layout
+    struct thread *self2;     // %fs:16
+    long  pad[2];
+    unsigned long canary;     // %fs:0x28, read by -fstack-protector
+    void *(*fn)(void *);
+    void *arg;
+    void *result;
+    int   tid;                // cleared by the kernel when the thread exits
+    void *map;                // guard + stack + TLS + this
+    long  map_size;
+};
+
+void thread_init(void);
+long thread_create(struct thread **t, void *(*fn)(void *), void *arg, long stack_size);  // 0 or -errno
+void *thread_join(struct thread *t);      // waits, frees the stack, returns fn's result
+struct thread *thread_self(void);
+
+long futex_wait(int *addr, int val);
+long futex_wake(int *addr, int n);
+
+struct mutex { int state; };              // zero is unlocked
+struct cond  { int seq; };                // zero is ready to use
+struct sem   { int count; int waiters; };
+
+void mutex_lock(struct mutex *m);
+int  mutex_trylock(struct mutex *m);      // 1 if we got it
+void mutex_unlock(struct mutex *m);
+void cond_wait(struct cond *c, struct mutex *m);
+void cond_signal(struct cond *c);
+void cond_broadcast(struct cond *c);
+void sem_init(struct sem *s, int value);
+void sem_wait(struct sem *s);
+int  sem_trywait(struct sem *s);          // 1 if we got it
+void sem_post(struct sem *s);
+
+// Work-stealing pool (pool.c)
+//
+// One Chase-Lev deque per worker. The thread that calls pool_init is
+// worker 0 and the other workers are threads of their own, so the pool
+// is driven from that thread or from inside its tasks. Idle workers
+// steal from random victims and then sleep on a futex until new work is
+// pushed.
+//
+// Work is a range [lo, hi) handed to fn(arg, lo, hi), typically byte
+// offsets into a buffer or an mmap'd file. A running range keeps pushing
+// its upper half for thieves until it is down to `grain`, so big chunks
+// go to whoever is free.
+#define POOL_MAX     256      // workers
+#define POOL_DEQUE   1024     // tasks per worker deque, a power of two
+#define POOL_PIN     1        // pin worker i to the i-th allowed CPU
+
+typedef void pool_fn(void *arg, long lo, long hi);
+
+struct pool_worker;
+
+struct pool
+{
+    struct pool_worker *workers;
+    int   n;
+    int   flags;
+    int   stop;
+    int   seq;                // bumped on every push that may need a sleeper
+    int   sleepers;
+    int   done;               // bumped whenever a task group drains, waiters sleep on it
+    void *map;
+    long  map_size;
+};
+
+struct task_group
+{
+    struct pool *pool;
+    pool_fn *fn;
+    void *arg;
+    long  grain;
+    int   pending;            // ranges queued or running
+};
+
+long pool_init(struct pool *p, int nthreads, int flags);    // 0 or -errno, nthreads <= 0 means one per CPU
+void pool_free(struct pool *p);                             // waits for the workers to exit
+void task_group_init(struct task_group *g, struct pool *p, pool_fn *fn, void *arg, long grain);
+void task_group_run(struct task_group *g, long lo, long hi);
+void task_group_wait(struct task_group *g);                 // runs tasks itself while it waits
+void parallel_for(struct pool *p, long lo, long hi, long grain, pool_fn *fn, void *arg);
+
+// Rings (ring.c)
+//
+// Lock-free bounded rings for passing bytes (spsc) or pointers (mpmc)
+// between threads. Capacities are powers of two and the caller owns the
+// memory. The hot indices sit on cache lines of their own. The blocking
+// calls spin briefly and then sleep on a futex.
+struct ring_event { int seq; int waiters; };
+
+struct spsc
+{
+    long  tail __attribute__((aligned(64)));   // producer's line
+    long  head_cache;
+    long  head __attribute__((aligned(64)));   // consumer's line
+    long  tail_cache;
+    struct ring_event data __attribute__((aligned(64)));
+    struct ring_event space;
+    int   closed;
+    char *buf;
+    long  cap;
+};
+
+void spsc_init(struct spsc *r, char *buf, long cap);
+long spsc_reserve(struct spsc *r, char **p);          // contiguous free bytes at *p, 0 when full
+void spsc_commit(struct spsc *r, long n);
+long spsc_peek(struct spsc *r, const char **p);       // contiguous readable bytes at *p
+void spsc_consume(struct spsc *r, long n);
+long spsc_wait_space(struct spsc *r, long n);         // free bytes, at least n (or cap)
+long spsc_wait_data(struct spsc *r, long n);          // readable bytes, fewer than n only once closed
+void spsc_close(struct spsc *r);                      // producer is done
+void spsc_write(struct spsc *r, const void *p, long n);
+long spsc_read(struct spsc *r, void *p, long n);      // 0 once closed and drained
+
+struct mpmc_slot { long seq; void *msg; };
+
+struct mpmc
+{
+    long head __attribute__((aligned(64)));
+    long tail __attribute__((aligned(64)));
+    struct ring_event not_empty __attribute__((aligned(64)));
+    struct ring_event not_full;
+    struct mpmc_slot *slots;
+    long mask;
+};
+
+void  mpmc_init(struct mpmc *q, struct mpmc_slot *slots, long cap);
+int   mpmc_trypush(struct mpmc *q, void *msg);        // 0 when full
+int   mpmc_trypop(struct mpmc *q, void **msg);        // 0 when empty
+void  mpmc_push(struct mpmc *q, void *msg);
+void *mpmc_pop(struct mpmc *q);
+
+// Performance counters (perf.c)
+//
+// perf_open starts counting on the calling thread and has rt_exit print
+// a table of per-phase deltas to stderr. perf_phase ends the running
+// phase and starts the named one, it's a no-op until perf_open. Tools
+// turn this on with --perf-stats or PERF_STATS=1.
+enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_CTX_SWITCHES,
+    PERF_COUNTERS
+};
+
+#define PERF_MAX_PHASES 16
+
+struct perf_sample { long v[PERF_COUNTERS]; };   // -1 where a counter isn't open
+
+long perf_open(void);                  // counters opened, or -errno when none did
+void perf_read(struct perf_sample *s);
+void perf_phase(const char *name);     // name must outlive the process
+
+// Benchmarks (bench.c)
+//
+// bench_run times fn on rdtsc/rdtscp after a warmup, in batches big
+// enough to drown the timer's own cost. It throws out the slow outliers
+// (preemption, interrupts), prints min/median/p99 per call and bytes/s,
+// and fills in r if it isn't 0. bench_init calibrates the TSC against
+// CLOCK_MONOTONIC and prints the table header.
+typedef void bench_fn(void *arg, long iters);   // do the work iters times
+
+#define BENCH_SAMPLES 256
+
+struct bench_result
+{
+    int    samples;           // kept
+    int    rejected;
+    double min_ns;            // per call
+    double median_ns;
+    double p99_ns;
+    double bytes_per_sec;     // at the median, 0 when bytes is 0
+};
+
+void bench_init(void);
+void bench_suite(const char *name);
+void bench_run(struct bench_result *r, const char *name, bench_fn *fn, void *arg, long bytes);
+
+// Event loop (loop.c)
+//
+// epoll, edge-triggered: a callback is told an fd became readable or
+// writable and has to read or write until EAGAIN before it will hear
+// about it again. Timers are timerfds and signals come in through a
+// signalfd, so all three are just watches on the same epoll fd. For
+// those two the loop reads the fd itself and fills in `expirations` or
+// `sig` before the callback runs.
+#define LOOP_FD     0
+#define LOOP_TIMER  1
+#define LOOP_SIGNAL 2
+
+#define LOOP_EVENTS 64        // per epoll_wait
+
+struct loop;
+struct loop_watch;
+typedef void loop_fn(struct loop *l, struct loop_watch *w, unsigned events);
+
+struct loop_watch
+{
+    int   fd;
+    int   kind;
+    loop_fn *fn;
+    void *data;
+    long  expirations;        // LOOP_TIMER: since the last callback
+    int   sig;                // LOOP_SIGNAL: the signal that arrived
+    int   pid;                //   and who sent it
+};
+
+struct loop
+{
+    int  epfd;
+    int  stop;
+    int  nwatches;
+    int  pending;             // events of the current batch not yet dispatched
+    struct epoll_event *batch;
+};
+
+long loop_init(struct loop *l);                  // 0 or -errno
+void loop_free(struct loop *l);
+long loop_add(struct loop *l, struct loop_watch *w, int fd, unsigned events, loop_fn *fn, void *data);
+long loop_mod(struct loop *l, struct loop_watch *w, unsigned events);
+long loop_del(struct loop *l, struct loop_watch *w);   // safe from inside a callback
+long loop_timer(struct loop *l, struct loop_watch *w, long first_ns, long interval_ns, loop_fn *fn, void *data);
+long loop_timer_set(struct loop_watch *w, long first_ns, long interval_ns);   // 0, 0 disarms
+long loop_signal(struct loop *l, struct loop_watch *w, unsigned long sigmask, loop_fn *fn, void *data);
+long loop_run(struct loop *l);                   // until loop_stop or nothing is watched
+void loop_stop(struct loop *l);
+
+long fd_nonblock(int fd);                        // sets O_NONBLOCK
+long nb_read(int fd, void *buf, long n);         // -EAGAIN when there's nothing, retries EINTR
+long nb_write(int fd, const void *buf, long n);  // as much as fits, -EAGAIN when nothing does
+
+// Coroutines (coro.c)
+//
+// Stackful coroutines on one thread. A coroutine runs until it yields or
+// waits for an fd, then the scheduler picks the next runnable one; when
+// none is runnable it sleeps in its own epoll until some fd is ready. So
+// I/O code can be a plain read/write loop, coro_read/coro_write park on
+// EAGAIN, and thousands of them share one core.
+//
+// Finished coroutines are freed by the scheduler. Only one coroutine
+// should wait on a given fd at a time.
+#define CORO_STACK   (64L * 1024)    // default stack size
+#define CORO_EVENTS  64              // per epoll_wait
+
+struct coro;
+struct sched;
+typedef void coro_fn(void *arg);
+
+struct coro
+{
+    void *sp;                 // saved rsp while switched out
+    struct sched *sched;
+    struct coro *next;        // run queue
+    coro_fn *fn;
+    void *arg;
+    unsigned events;          // what coro_wait woke up for
+    int   done;
+    void *map;                // guard + stack + this
+    long  map_size;
+};
+
+struct sched
+{
+    void *sp;                 // sched_run's own context
+    struct coro *current;
+    struct coro *head;        // runnable, oldest first
+    struct coro *tail;
+    int   epfd;
+    int   live;               // spawned and not finished
+};
+
+long sched_init(struct sched *s);                // 0 or -errno
+void sched_free(struct sched *s);
+long coro_spawn(struct sched *s, coro_fn *fn, void *arg, long stack_size);   // 0 or -errno, stack_size <= 0 means CORO_STACK
+long sched_run(struct sched *s);                 // until every coroutine has finished, 0 or -errno
+struct coro *coro_self(void);                    // 0 outside a coroutine
+void coro_yield(void);
+long coro_wait(int fd, unsigned events);         // parks until fd is ready, the epoll events or -errno
+long coro_read(int fd, void *buf, long n);       // fd must be nonblocking
+long coro_write(int fd, const void *buf, long n);   // all of it, or -errno
+
+// Output streams (out.c)
+//
+// Small writes are copied into the stream's buffer, bigger ones and
+// out_ref'd memory are queued as iovecs, and everything queued goes out
+// in one writev. Short writes and EINTR are retried until it's all out.
+// Every stream is flushed once more on the way out (rt_exit).
+#define OUT_IOV       64      // iovecs per writev
+#define OUT_COPY_MAX  32      // refs shorter than this are copied instead
+
+struct out
+{
+    int   fd;
+    long  err;                // first write error, -errno, sticky
+    char *buf;
+    long  cap;
+    long  len;                // bytes of buf in use
+    struct iovec iov[OUT_IOV];
+    int   niov;
+    struct out *next;         // flush-at-exit list
+};
+
+void out_init(struct out *o, int fd, char *buf, long cap);
+long out_write(struct out *o, const void *p, long n);   // copied unless it's big
+long out_ref(struct out *o, const void *p, long n);     // p must stay valid until the next flush
+long out_str(struct out *o, const char *s);
+long out_dec(struct out *o, long v, int width);         // decimal, right-aligned in width
+long out_flush(struct out *o);
+long out_flush_all(void);
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+
+// strings (string.c)
+//
+// The plain names dispatch through `kernels` (cpu.c); the _scalar/_sse2/
+// _avx2/_avx512 variants are there to call directly.
+size_t strlen(const char *s);
+int    strcmp(const char *a, const char *b);
+void  *memchr(const void *s, int c, size_t n);
+void  *memcpy(void *dst, const void *src, size_t n);
+void  *memmove(void *dst, const void *src, size_t n);
+void  *memset(void *dst, int c, size_t n);
+
+size_t strlen_scalar(const char *s);
+size_t strlen_sse2(const char *s);
+size_t strlen_avx2(const char *s);
+int    strcmp_scalar(const char *a, const char *b);
+int    strcmp_sse2(const char *a, const char *b);
+int    strcmp_avx2(const char *a, const char *b);
+void  *memchr_scalar(const void *s, int c, size_t n);
+void  *memchr_sse2(const void *s, int c, size_t n);
+void  *memchr_avx2(const void *s, int c, size_t n);
+void  *memcpy_scalar(void *dst, const void *src, size_t n);
+void  *memcpy_sse2(void *dst, const void *src, size_t n);
+void  *memcpy_avx2(void *dst, const void *src, size_t n);
+void  *memset_scalar(void *dst, int c, size_t n);
+void  *memset_sse2(void *dst, int c, size_t n);
+void  *memset_avx2(void *dst, int c, size_t n);
+size_t strlen_avx512(const char *s);
+void  *memchr_avx512(const void *s, int c, size_t n);
+void  *memcpy_avx512(void *dst, const void *src, size_t n);
+void  *memset_avx512(void *dst, int c, size_t n);
+
+// CPU features and dispatch (cpu.c)
+//
+// cpu_init runs CPUID/XGETBV once from start_main and points every entry
+// in `kernels` at the widest variant both the CPU and the OS support.
+struct cpu_features
+{
+    int sse2;
+    int sse42;
+    int popcnt;
+    int avx;          // these three also need the OS to save the registers
+    int avx2;
+    int avx512f;
+    int avx512bw;
+    int bmi2;
+};
+
+struct kernels
+{
+    size_t (*strlen)(const char *s);
+    int    (*strcmp)(const char *a, const char *b);
+    void  *(*memchr)(const void *s, int c, size_t n);
+    void  *(*memcpy)(void *dst, const void *src, size_t n);
+    void  *(*memset)(void *dst, int c, size_t n);
+};
+
+extern struct cpu_features cpu;
+extern struct kernels kernels;
+
+void cpu_init(void);
+
 #endif
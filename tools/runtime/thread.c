@@ -0,0 +1,320 @@
+// thread.c
+//
+// Threads straight on clone(2), no pthreads.
+//
+// Each thread gets one mapping:
+//
+//   [guard page][stack ............][TLS block][struct thread]
+//                                              ^ %fs points here
+//
+// That's the x86-64 "variant II" TLS layout gcc expects: __thread
+// variables sit just below the thread pointer, and the first word at the
+// thread pointer points to itself. The main thread gets the same block
+// (minus the stack) in thread_init so __thread works there too.
+#include <elf.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <linux/sched.h>
+#include <sys/mman.h>
+
+#include "sys.h"
+
+#define ARCH_SET_FS   0x1002
+#define PAGE          4096L
+#define STACK_DEFAULT (256L * 1024)
+
+#define CLONE_THREAD_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | \
+                            CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS |        \
+                            CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+
+// the initial TLS image from the PT_TLS segment
+static struct
+{
+    const char *image;
+    long filesz;
+    long memsz;
+    long align;     // the segment's p_align
+    long size;      // memsz rounded up to align, what sits below %fs;
+                    // the linker baked in the same offsets, so it must match
+} tls;
+
+static struct thread main_thread_fallback;
+
+static long align_up(long n, long to)
+{
+    return (n + to - 1) & ~(to - 1);
+}
+
+static void tls_find(void)
+{
+    Elf64_Phdr *ph = (Elf64_Phdr *)auxv_get(AT_PHDR);
+    long phnum = auxv_get(AT_PHNUM);
+    long bias = 0;
+
+    tls.align = 1;
+    for (long i = 0; ph && i < phnum; i++)
+    {
+        if (ph[i].p_type == PT_PHDR) bias = (long)ph - ph[i].p_vaddr;
+    }
+    for (long i = 0; ph && i < phnum; i++)
+    {
+        if (ph[i].p_type != PT_TLS) continue;
+        tls.image  = (const char *)(bias + ph[i].p_vaddr);
+        tls.filesz = ph[i].p_filesz;
+        tls.memsz  = ph[i].p_memsz;
+        if ((long)ph[i].p_align > tls.align) tls.align = ph[i].p_align;
+    }
+    tls.size = align_up(tls.memsz, tls.align);
+}
+
+// Lay out a TLS block and thread control block ending at `top`, copying
+// in .tdata (the mapping is fresh, so .tbss is already zero).
+static struct thread *tls_setup(char *top)
+{
+    long align = tls.align > 16 ? tls.align : 16;
+    struct thread *t = (struct thread *)(((long)top - sizeof(struct thread)) & ~(align - 1));
+    char *block = (char *)t - tls.size;
+    memcpy(block, tls.image, tls.filesz);
+
+    t->self  = t;
+    t->self2 = t;
+    return t;
+}
+
+static long tls_bytes(void)
+{
+    return tls.size + sizeof(struct thread) + tls.align + 16;
+}
+
+void thread_init(void)
+{
+    tls_find();
+
+    long size = align_up(tls_bytes(), PAGE);
+    char *map = sys_mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct thread *t = &main_thread_fallback;
+    if (!SYS_MMAP_FAILED(map))
+    {
+        t = tls_setup(map + size);
+        t->map = map;
+        t->map_size = size;
+    }
+    t->self  = t;
+    t->self2 = t;
+    t->tid   = sys_gettid();
+
+    // reuse the kernel's random bytes for -fstack-protector
+    unsigned long *rnd = (unsigned long *)auxv_get(AT_RANDOM);
+    if (rnd) t->canary = rnd[0] & ~0xffUL;
+
+    sys_arch_prctl(ARCH_SET_FS, (unsigned long)t);
+}
+
+// the child's first C code, on its own stack
+__attribute__((noreturn, used))
+void thread_entry(struct thread *t)
+{
+    t->result = t->fn(t->arg);
+    // exit just this thread; the kernel clears t->tid and wakes joiners
+    for (;;) syscall1(SYS_exit, 0);
+}
+
+static long clone_thread(void *stack, struct thread *t)
+{
+    long ret;
+    register long r10 __asm__("r10") = (long)&t->tid;   // child_tid
+    register long r8  __asm__("r8")  = (long)t;         // tls
+    register long r9  __asm__("r9")  = (long)t;         // survives into the child
+
+    // The child comes back from the syscall on the new stack with nothing
+    // of this frame usable, so it goes straight to thread_entry from here.
+    asm volatile (
+        "syscall\n\t"
+        "test %%rax, %%rax\n\t"
+        "jnz 1f\n\t"
+        "xor %%ebp, %%ebp\n\t"
+        "mov %%r9, %%rdi\n\t"
+        "and $-16, %%rsp\n\t"
+        "call thread_entry\n\t"
+        "hlt\n"
+        "1:"
+        : "=a"(ret)
+        : "a"(SYS_clone), "D"((long)CLONE_THREAD_FLAGS), "S"(stack),
+          "d"(&t->tid), "r"(r10), "r"(r8), "r"(r9)
+        : "rcx", "r11", "memory"
+    );
+    return ret;
+}
+
+long thread_create(struct thread **out, void *(*fn)(void *), void *arg, long stack_size)
+{
+    if (stack_size <= 0) stack_size = STACK_DEFAULT;
+    stack_size = align_up(stack_size, PAGE);
+
+    long size = PAGE + stack_size + align_up(tls_bytes(), PAGE);
+    char *map = sys_mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (SYS_MMAP_FAILED(map))
+    {
+        return (long)map;
+    }
+    // overflowing the stack faults instead of walking into other memory
+    sys_mprotect(map, PAGE, PROT_NONE);
+
+    struct thread *t = tls_setup(map + size);
+    t->fn = fn;
+    t->arg = arg;
+    t->map = map;
+    t->map_size = size;
+    t->canary = thread_self()->canary;
+
+    char *stack = (char *)((long)((char *)t - tls.size) & ~15L);
+    long ret = clone_thread(stack, t);
+    if (ret < 0)
+    {
+        sys_munmap(map, size);
+        return ret;
+    }
+
+    *out = t;
+    return 0;
+}
+
+void *thread_join(struct thread *t)
+{
+    // CLONE_CHILD_CLEARTID zeroes tid and futex-wakes it once the thread
+    // is gone for good, after which its stack is safe to unmap. The
+    // kernel's wake is a shared one, so a _PRIVATE wait would never see it.
+    int tid;
+    while ((tid = __atomic_load_n(&t->tid, __ATOMIC_ACQUIRE)) != 0)
+    {
+        sys_futex(&t->tid, FUTEX_WAIT, tid, 0, 0, 0);
+    }
+
+    void *result = t->result;
+    sys_munmap(t->map, t->map_size);
+    return result;
+}
+
+struct thread *thread_self(void)
+{
+    struct thread *t;
+    asm ("mov %%fs:0, %0" : "=r"(t));
+    return t;
+}
+
+// futex
+
+long futex_wait(int *addr, int val)
+{
+    return sys_futex(addr, FUTEX_WAIT_PRIVATE, val, 0, 0, 0);
+}
+
+long futex_wake(int *addr, int n)
+{
+    return sys_futex(addr, FUTEX_WAKE_PRIVATE, n, 0, 0, 0);
+}
+
+// mutex: 0 unlocked, 1 locked, 2 locked and someone may be sleeping.
+// Uncontended lock and unlock are a single atomic each, no syscall.
+
+void mutex_lock(struct mutex *m)
+{
+    int c = 0;
+    if (__atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    // mark it contended before sleeping so unlock knows to wake us
+    if (c != 2)
+    {
+        c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0)
+    {
+        futex_wait(&m->state, 2);
+        c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+int mutex_trylock(struct mutex *m)
+{
+    int c = 0;
+    return __atomic_compare_exchange_n(&m->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void mutex_unlock(struct mutex *m)
+{
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+    {
+        futex_wake(&m->state, 1);
+    }
+}
+
+// condition variable: waiters sleep on a sequence number that every
+// signal bumps, so a signal between unlock and futex_wait isn't lost
+
+void cond_wait(struct cond *c, struct mutex *m)
+{
+    int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    mutex_unlock(m);
+    futex_wait(&c->seq, seq);
+
+    // someone else may be waiting on the mutex too, so take it as contended
+    while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+    {
+        futex_wait(&m->state, 2);
+    }
+}
+
+void cond_signal(struct cond *c)
+{
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&c->seq, 1);
+}
+
+void cond_broadcast(struct cond *c)
+{
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&c->seq, 0x7fffffff);
+}
+
+// semaphore
+
+void sem_init(struct sem *s, int value)
+{
+    s->count = value;
+    s->waiters = 0;
+}
+
+int sem_trywait(struct sem *s)
+{
+    int v = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    while (v > 0)
+    {
+        if (__atomic_compare_exchange_n(&s->count, &v, v - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sem_wait(struct sem *s)
+{
+    while (!sem_trywait(s))
+    {
+        __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&s->count, 0);
+        __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void sem_post(struct sem *s)
+{
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+    {
+        futex_wake(&s->count, 1);
+    }
+}
@@ -0,0 +1,183 @@
+// trace.c
+//
+// The recording side of RT_TRACE. Each thread gets its own ring the
+// first time it records something, so recording is a rdtsc and a few
+// stores with no locking. A full ring overwrites its oldest events.
+//
+// This file's own syscalls must not be traced, or recording an mmap
+// would record an mmap, so it builds the untraced wrappers.
+#undef RT_TRACE
+
+#include <sys/mman.h>
+
+#include "sys.h"
+
+#define TRACE_EVENTS (1 << 16)     // per thread, 4 MiB
+
+struct trace_ring
+{
+    struct trace_ring *next;       // every thread's ring, for the dump
+    int  tid;
+    unsigned long count;           // recorded so far, the ring keeps the last TRACE_EVENTS
+    struct trace_event ev[TRACE_EVENTS];
+};
+
+static struct trace_ring *rings;
+static int ready;                  // no TLS before thread_init
+static __thread struct trace_ring *ring;
+
+static unsigned long tsc_start;
+static unsigned long ns_start;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime_fast(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void trace_init(void)
+{
+    ns_start = now_ns();
+    tsc_start = rdtsc();
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+static struct trace_event *next_event(void)
+{
+    // ring itself is TLS, don't touch it before thread_init
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    struct trace_ring *r = ring;
+    if (!r)
+    {
+        r = sys_mmap(0, sizeof(*r), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (SYS_MMAP_FAILED(r))
+        {
+            return 0;
+        }
+        r->tid = sys_gettid();
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        ring = r;
+    }
+    return &r->ev[r->count++ & (TRACE_EVENTS - 1)];
+}
+
+void trace_syscall(long nr, long a1, long a2, long a3, long a4, long ret, unsigned long start)
+{
+    unsigned long end = rdtsc();
+    struct trace_event *e = next_event();
+    if (!e)
+    {
+        return;
+    }
+    e->start  = start;
+    e->end    = end;
+    e->kind   = TRACE_SYSCALL;
+    e->nr     = nr;
+    e->ret    = ret;
+    e->arg[0] = a1;
+    e->arg[1] = a2;
+    e->arg[2] = a3;
+    e->arg[3] = a4;
+}
+
+void trace_span(const char *name, unsigned long start)
+{
+    unsigned long end = rdtsc();
+    struct trace_event *e = next_event();
+    if (!e)
+    {
+        return;
+    }
+    e->start = start;
+    e->end   = end;
+    e->kind  = TRACE_SPAN;
+    e->nr    = 0;
+    e->ret   = 0;
+
+    int i = 0;
+    for (; name[i] && i < (int)sizeof(e->name) - 1; i++) e->name[i] = name[i];
+    e->name[i] = 0;
+}
+
+static char *put_dec(char *p, long v)
+{
+    char tmp[24];
+    int n = 0;
+    do tmp[n++] = '0' + v % 10; while (v /= 10);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+// Called by rt_exit after the streams are flushed. Threads still running
+// keep recording while we write, so their last few events may be torn.
+void trace_dump(void)
+{
+    if (!ready)
+    {
+        return;
+    }
+
+    char path[64];
+    const char *file = env_get("RT_TRACE_FILE");
+    if (!file)
+    {
+        char *p = path;
+        for (const char *s = "trace."; *s; ) *p++ = *s++;
+        p = put_dec(p, sys_getpid());
+        for (const char *s = ".bin"; *s; ) *p++ = *s++;
+        *p = 0;
+        file = path;
+    }
+
+    int fd = sys_open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    static struct trace_file hdr = { "RTTRACE1", 0, 0, 0, 0, 0, 0 };
+    hdr.tsc_start = tsc_start;
+    hdr.ns_start  = ns_start;
+    hdr.ns_end    = now_ns();
+    hdr.tsc_end   = rdtsc();
+    hdr.pid       = sys_getpid();
+    for (struct trace_ring *r = rings; r; r = r->next) hdr.nthreads++;
+
+    static char buf[4096];
+    static struct out o;
+    out_init(&o, fd, buf, sizeof(buf));
+    out_write(&o, &hdr, sizeof(hdr));
+
+    for (struct trace_ring *r = rings; r; r = r->next)
+    {
+        struct trace_thread t = {0};
+        long count = r->count;
+        t.tid = r->tid;
+        t.nevents = count < TRACE_EVENTS ? count : TRACE_EVENTS;
+        t.dropped = count - t.nevents;
+        out_write(&o, &t, sizeof(t));
+
+        // oldest first: once the ring has wrapped that's the part from the
+        // write position on, then the start
+        long at = count & (TRACE_EVENTS - 1);
+        if (count >= TRACE_EVENTS)
+        {
+            out_ref(&o, &r->ev[at], (TRACE_EVENTS - at) * sizeof(struct trace_event));
+            out_ref(&o, &r->ev[0], at * sizeof(struct trace_event));
+        }
+        else
+        {
+            out_ref(&o, &r->ev[0], count * sizeof(struct trace_event));
+        }
+    }
+
+    out_flush(&o);
+    sys_close(fd);
+}
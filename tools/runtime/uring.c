@@ -0,0 +1,193 @@
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "sys.h"
+#include "uring.h"
+
+static void *map_ring(int fd, long size, long offset)
+{
+    return sys_mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+// Kernels before 5.6 set up a ring but fail IORING_OP_READ/WRITE with
+// -EINVAL. The probe opcode arrived in the same release, so a failed
+// probe means the ops we need are missing too.
+static int supports_read_write(int fd)
+{
+    union
+    {
+        struct io_uring_probe probe;
+        char bytes[sizeof(struct io_uring_probe) + (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op)];
+    } u;
+    for (unsigned long i = 0; i < sizeof(u); i++) u.bytes[i] = 0;
+
+    if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, &u.probe, IORING_OP_WRITE + 1) < 0)
+    {
+        return 0;
+    }
+    if (u.probe.last_op < IORING_OP_WRITE)
+    {
+        return 0;
+    }
+    return (u.probe.ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+           (u.probe.ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+}
+
+long uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned char *z = (unsigned char *)&p;
+    for (unsigned long i = 0; i < sizeof(p); i++) z[i] = 0;
+
+    long fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    if (!supports_read_write(fd))
+    {
+        sys_close(fd);
+        return -EOPNOTSUPP;
+    }
+    r->fd = fd;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels put both rings behind the same mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = 0;
+    }
+
+    r->sq_ring = map_ring(fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+    if (SYS_MMAP_FAILED(r->sq_ring))
+    {
+        sys_close(fd);
+        return (long)r->sq_ring;
+    }
+
+    r->cq_ring = r->sq_ring;
+    if (r->cq_ring_size)
+    {
+        r->cq_ring = map_ring(fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+        if (SYS_MMAP_FAILED(r->cq_ring))
+        {
+            long err = (long)r->cq_ring;
+            sys_munmap(r->sq_ring, r->sq_ring_size);
+            sys_close(fd);
+            return err;
+        }
+    }
+
+    r->sqes = map_ring(fd, r->sqes_size, IORING_OFF_SQES);
+    if (SYS_MMAP_FAILED(r->sqes))
+    {
+        long err = (long)r->sqes;
+        if (r->cq_ring_size) sys_munmap(r->cq_ring, r->cq_ring_size);
+        sys_munmap(r->sq_ring, r->sq_ring_size);
+        sys_close(fd);
+        return err;
+    }
+
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+
+    r->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask    = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+    r->sq_pending = *r->sq_tail;
+
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_free(struct uring *r)
+{
+    sys_munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring_size) sys_munmap(r->cq_ring, r->cq_ring_size);
+    sys_munmap(r->sq_ring, r->sq_ring_size);
+    sys_close(r->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_pending - head >= r->sq_entries)
+    {
+        return 0;
+    }
+
+    unsigned idx = r->sq_pending & r->sq_mask;
+    r->sq_array[idx] = idx;
+    r->sq_pending++;
+
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    unsigned long *z = (unsigned long *)sqe;
+    for (unsigned long i = 0; i < sizeof(*sqe) / sizeof(*z); i++) z[i] = 0;
+    return sqe;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *buf, unsigned len, long off, unsigned long user_data)
+{
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (unsigned long)buf;
+    sqe->len       = len;
+    sqe->off       = off;   // -1 means "at the current file position"
+    sqe->user_data = user_data;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, long off, unsigned long user_data)
+{
+    prep_rw(sqe, IORING_OP_READ, fd, buf, len, off, user_data);
+}
+
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len, long off, unsigned long user_data)
+{
+    prep_rw(sqe, IORING_OP_WRITE, fd, buf, len, off, user_data);
+}
+
+long uring_submit(struct uring *r, unsigned wait_nr)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned to_submit = r->sq_pending - tail;
+
+    // the sqes must be visible before the kernel sees the new tail
+    __atomic_store_n(r->sq_tail, r->sq_pending, __ATOMIC_RELEASE);
+
+    if (!to_submit && !wait_nr)
+    {
+        return 0;
+    }
+
+    while (1)
+    {
+        long ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (ret == -EINTR) continue;
+        return ret;
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,54 @@
+#ifndef _FAILBOT_URING_H
+#define _FAILBOT_URING_H
+
+#include <linux/io_uring.h>
+
+// A bare io_uring: the kernel's submission and completion rings mapped
+// straight into our address space, no liburing.
+struct uring
+{
+    int fd;
+
+    // submission ring (kernel owns head, we own tail)
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+    unsigned  sq_pending;     // sqes handed out but not yet published
+    struct io_uring_sqe *sqes;
+
+    // completion ring (kernel owns tail, we own head)
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // mappings, for uring_free
+    void *sq_ring;
+    long  sq_ring_size;
+    void *cq_ring;
+    long  cq_ring_size;
+    long  sqes_size;
+};
+
+// Returns 0 or -errno (e.g. -ENOSYS/-EPERM where io_uring is disabled,
+// -EOPNOTSUPP where the kernel lacks IORING_OP_READ/WRITE).
+long uring_init(struct uring *r, unsigned entries);
+void uring_free(struct uring *r);
+
+// Next free sqe, zeroed, or 0 if the submission ring is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, long off, unsigned long user_data);
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len, long off, unsigned long user_data);
+
+// Publish pending sqes and enter the kernel, optionally waiting for
+// wait_nr completions. Returns the number submitted or -errno.
+long uring_submit(struct uring *r, unsigned wait_nr);
+
+// Next completion or 0 if the ring is empty. Call uring_cqe_seen once
+// done with it so the kernel can reuse the slot.
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#endif
@@ -0,0 +1,153 @@
+// vdso.c
+//
+// The kernel maps a tiny shared object (the vDSO) into every process and
+// hands us its address as AT_SYSINFO_EHDR. Its clock_gettime,
+// gettimeofday and getcpu read kernel-maintained data from user space,
+// so a timestamp costs a few dozen cycles instead of a syscall. There's
+// no dynamic linker here, so we look the symbols up ourselves.
+#include <elf.h>
+
+#include "sys.h"
+
+struct vdso vdso;
+
+struct vdso_image
+{
+    long base;              // load bias, added to every address in the image
+    Elf64_Sym *symtab;
+    const char *strtab;
+    unsigned long nsyms;
+};
+
+// DT_GNU_HASH doesn't store the symbol count, walk the chains to find
+// the highest index
+static unsigned long gnu_hash_nsyms(const unsigned *h)
+{
+    unsigned nbuckets  = h[0];
+    unsigned symoffset = h[1];
+    unsigned bloomsize = h[2];
+    const unsigned *buckets = (const unsigned *)((const unsigned long *)(h + 4) + bloomsize);
+    const unsigned *chain   = buckets + nbuckets;
+
+    unsigned last = 0;
+    for (unsigned i = 0; i < nbuckets; i++)
+    {
+        if (buckets[i] > last) last = buckets[i];
+    }
+    if (last < symoffset)
+    {
+        return symoffset;
+    }
+    while (!(chain[last - symoffset] & 1)) last++;
+    return last + 1;
+}
+
+static int vdso_open(struct vdso_image *img, Elf64_Ehdr *eh)
+{
+    if (!eh || eh->e_ident[EI_MAG0] != ELFMAG0 || eh->e_ident[EI_MAG1] != ELFMAG1 ||
+        eh->e_ident[EI_MAG2] != ELFMAG2 || eh->e_ident[EI_MAG3] != ELFMAG3 ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64)
+    {
+        return 0;
+    }
+
+    Elf64_Phdr *ph = (Elf64_Phdr *)((char *)eh + eh->e_phoff);
+    Elf64_Dyn *dyn = 0;
+    int have_load = 0;
+
+    for (int i = 0; i < eh->e_phnum; i++)
+    {
+        if (ph[i].p_type == PT_LOAD && !have_load)
+        {
+            img->base = (long)eh + ph[i].p_offset - ph[i].p_vaddr;
+            have_load = 1;
+        }
+        else if (ph[i].p_type == PT_DYNAMIC)
+        {
+            dyn = (Elf64_Dyn *)((char *)eh + ph[i].p_offset);
+        }
+    }
+    if (!have_load || !dyn)
+    {
+        return 0;
+    }
+
+    const unsigned *hash = 0;
+    const unsigned *gnu_hash = 0;
+    img->symtab = 0;
+    img->strtab = 0;
+
+    for (; dyn->d_tag != DT_NULL; dyn++)
+    {
+        void *p = (void *)(img->base + dyn->d_un.d_ptr);
+        switch (dyn->d_tag)
+        {
+            case DT_SYMTAB:   img->symtab = p; break;
+            case DT_STRTAB:   img->strtab = p; break;
+            case DT_HASH:     hash = p; break;
+            case DT_GNU_HASH: gnu_hash = p; break;
+        }
+    }
+    if (!img->symtab || !img->strtab || (!hash && !gnu_hash))
+    {
+        return 0;
+    }
+
+    // DT_HASH: nbucket, nchain, ... and nchain is the symbol count
+    img->nsyms = hash ? hash[1] : gnu_hash_nsyms(gnu_hash);
+    return 1;
+}
+
+// Linear scan: it runs three times at startup over a few dozen symbols,
+// not worth the hash tables.
+static void *vdso_lookup(struct vdso_image *img, const char *name)
+{
+    for (unsigned long i = 0; i < img->nsyms; i++)
+    {
+        Elf64_Sym *sym = &img->symtab[i];
+        int type = ELF64_ST_TYPE(sym->st_info);
+        int bind = ELF64_ST_BIND(sym->st_info);
+
+        if (sym->st_shndx == SHN_UNDEF || type != STT_FUNC ||
+            (bind != STB_GLOBAL && bind != STB_WEAK))
+        {
+            continue;
+        }
+        if (strcmp(img->strtab + sym->st_name, name) == 0)
+        {
+            return (void *)(img->base + sym->st_value);
+        }
+    }
+    return 0;
+}
+
+void vdso_init(void)
+{
+    struct vdso_image img;
+    if (!vdso_open(&img, (Elf64_Ehdr *)auxv_get(AT_SYSINFO_EHDR)))
+    {
+        return;
+    }
+
+    vdso.clock_gettime = vdso_lookup(&img, "__vdso_clock_gettime");
+    vdso.gettimeofday  = vdso_lookup(&img, "__vdso_gettimeofday");
+    vdso.getcpu        = vdso_lookup(&img, "__vdso_getcpu");
+}
+
+long clock_gettime_fast(int clock, struct timespec *ts)
+{
+    if (vdso.clock_gettime) return (long)vdso.clock_gettime(clock, ts);
+    return sys_clock_gettime(clock, ts);
+}
+
+long gettimeofday_fast(struct timeval *tv)
+{
+    if (vdso.gettimeofday) return (long)vdso.gettimeofday(tv, 0);
+    return sys_gettimeofday(tv, 0);
+}
+
+long getcpu_fast(unsigned *cpu, unsigned *node)
+{
+    if (vdso.getcpu) return (long)vdso.getcpu(cpu, node, 0);
+    return sys_getcpu(cpu, node);
+}
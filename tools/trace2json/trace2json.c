@@ -0,0 +1,209 @@
+// trace2json
+//
+// Turns a trace.<pid>.bin from an RT_TRACE build into Chrome trace JSON,
+// for chrome://tracing or ui.perfetto.dev:
+//
+//   TRACE=1 ./tools/build.sh
+//   ./tools/build/cat big.txt > /dev/null
+//   ./tools/build/trace2json trace.1234.bin > trace.json
+#include "../runtime/sys.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+static const char *names[] =
+{
+    [SYS_read]              = "read",
+    [SYS_write]             = "write",
+    [SYS_open]              = "open",
+    [SYS_openat]            = "openat",
+    [SYS_close]             = "close",
+    [SYS_fstat]             = "fstat",
+    [SYS_lseek]             = "lseek",
+    [SYS_mmap]              = "mmap",
+    [SYS_mprotect]          = "mprotect",
+    [SYS_munmap]            = "munmap",
+    [SYS_ioctl]             = "ioctl",
+    [SYS_pread64]           = "pread",
+    [SYS_pwrite64]          = "pwrite",
+    [SYS_readv]             = "readv",
+    [SYS_writev]            = "writev",
+    [SYS_sched_yield]       = "sched_yield",
+    [SYS_madvise]           = "madvise",
+    [SYS_dup]               = "dup",
+    [SYS_nanosleep]         = "nanosleep",
+    [SYS_getpid]            = "getpid",
+    [SYS_sendfile]          = "sendfile",
+    [SYS_clone]             = "clone",
+    [SYS_exit]              = "exit",
+    [SYS_kill]              = "kill",
+    [SYS_fcntl]             = "fcntl",
+    [SYS_gettimeofday]      = "gettimeofday",
+    [SYS_arch_prctl]        = "arch_prctl",
+    [SYS_readahead]         = "readahead",
+    [SYS_gettid]            = "gettid",
+    [SYS_futex]             = "futex",
+    [SYS_sched_setaffinity] = "sched_setaffinity",
+    [SYS_sched_getaffinity] = "sched_getaffinity",
+    [SYS_fadvise64]         = "fadvise",
+    [SYS_clock_gettime]     = "clock_gettime",
+    [SYS_exit_group]        = "exit_group",
+    [SYS_splice]            = "splice",
+    [SYS_dup3]              = "dup3",
+    [SYS_pipe2]             = "pipe2",
+    [SYS_perf_event_open]   = "perf_event_open",
+    [SYS_getcpu]            = "getcpu",
+    [SYS_copy_file_range]   = "copy_file_range",
+    [SYS_io_uring_setup]    = "io_uring_setup",
+    [SYS_io_uring_enter]    = "io_uring_enter",
+};
+
+static struct out out;
+static const struct trace_file *hdr;
+
+// ticks since the start of the trace, in ns
+static long ns(unsigned long tsc)
+{
+    unsigned long ticks = hdr->tsc_end - hdr->tsc_start;
+    if (ticks == 0) return 0;
+    // in double: a 128-bit divide would need libgcc
+    return (double)(tsc - hdr->tsc_start) * (hdr->ns_end - hdr->ns_start) / ticks;
+}
+
+// Chrome wants microseconds
+static void put_us(long v)
+{
+    out_dec(&out, v / 1000, 0);
+    out_write(&out, ".", 1);
+    long frac = v % 1000;
+    if (frac < 100) out_write(&out, "0", 1);
+    if (frac < 10)  out_write(&out, "0", 1);
+    out_dec(&out, frac, 0);
+}
+
+static void put_name(const char *s, long max)
+{
+    for (long i = 0; i < max && s[i]; i++)
+    {
+        if (s[i] == '"' || s[i] == '\\') out_write(&out, "\\", 1);
+        if ((unsigned char)s[i] >= ' ') out_write(&out, &s[i], 1);
+    }
+}
+
+static void put_event(const struct trace_event *e, int tid, int first)
+{
+    out_str(&out, first ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+    if (e->kind == TRACE_SPAN)
+    {
+        put_name(e->name, sizeof(e->name));
+    }
+    else if (e->nr >= 0 && e->nr < (long)(sizeof(names) / sizeof(names[0])) && names[e->nr])
+    {
+        out_str(&out, names[e->nr]);
+    }
+    else
+    {
+        out_str(&out, "syscall ");
+        out_dec(&out, e->nr, 0);
+    }
+
+    out_str(&out, e->kind == TRACE_SPAN ? "\",\"cat\":\"span\"" : "\",\"cat\":\"syscall\"");
+    out_str(&out, ",\"ph\":\"X\",\"pid\":");
+    out_dec(&out, hdr->pid, 0);
+    out_str(&out, ",\"tid\":");
+    out_dec(&out, tid, 0);
+    out_str(&out, ",\"ts\":");
+    put_us(ns(e->start));
+    out_str(&out, ",\"dur\":");
+    put_us(ns(e->end) - ns(e->start));
+
+    if (e->kind == TRACE_SYSCALL)
+    {
+        out_str(&out, ",\"args\":{\"args\":[");
+        for (int i = 0; i < 4; i++)
+        {
+            if (i) out_write(&out, ",", 1);
+            out_dec(&out, e->arg[i], 0);
+        }
+        out_str(&out, "],\"ret\":");
+        out_dec(&out, e->ret, 0);
+        out_write(&out, "}", 1);
+    }
+    out_write(&out, "}", 1);
+}
+
+static int is_trace(const struct trace_file *h)
+{
+    static const char magic[8] = "RTTRACE1";
+    for (int i = 0; i < 8; i++)
+    {
+        if (h->magic[i] != magic[i]) return 0;
+    }
+    return 1;
+}
+
+static long fail(const char *msg, long len)
+{
+    sys_write(STDERR, msg, len);
+    return 1;
+}
+
+long main_start(uintptr_t *rsp)
+{
+    long argc = (long)rsp[0];
+    char **argv = (char **)(rsp + 1);
+
+    static char buf[64 * 1024];
+    out_init(&out, STDOUT, buf, sizeof(buf));
+
+    if (argc != 2)
+    {
+        static const char err[] = "usage: trace2json trace.bin\n";
+        return fail(err, sizeof(err)-1);
+    }
+
+    int fd = sys_open(argv[1], O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || sys_fstat(fd, &st) < 0)
+    {
+        static const char err[] = "Could not open file\n";
+        return fail(err, sizeof(err)-1);
+    }
+
+    long size = st.st_size;
+    const char *p = sys_mmap(0, size > 0 ? size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    hdr = (const struct trace_file *)p;
+    if (SYS_MMAP_FAILED(p) || size < (long)sizeof(*hdr) || !is_trace(hdr))
+    {
+        static const char err[] = "not a trace file\n";
+        return fail(err, sizeof(err)-1);
+    }
+
+    out_str(&out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *at = p + sizeof(*hdr);
+    const char *end = p + size;
+    int first = 1;
+    for (int t = 0; t < hdr->nthreads; t++)
+    {
+        const struct trace_thread *th = (const struct trace_thread *)at;
+        at += sizeof(*th);
+        if (at > end || th->nevents > (end - at) / (long)sizeof(struct trace_event))
+        {
+            static const char err[] = "trace file is truncated\n";
+            out_flush(&out);
+            return fail(err, sizeof(err)-1);
+        }
+
+        const struct trace_event *e = (const struct trace_event *)at;
+        for (long i = 0; i < th->nevents; i++)
+        {
+            put_event(&e[i], th->tid, first);
+            first = 0;
+        }
+        at += th->nevents * sizeof(struct trace_event);
+    }
+    out_str(&out, "\n]}\n");
+
+    return out_flush(&out) < 0;
+}